@@ -0,0 +1,423 @@
+/*
+ *  p44ledchainbench - host side benchmark for the p44-ledchain PWM pattern encoder
+ *
+ *  Copyright (C) 2017-2021 Lukas Zeller <luz@plan44.ch>
+ *
+ *  This is free software, licensed under the GNU General Public License v2.
+ *  See /LICENSE for more information.
+ *
+ *  Builds the driver's encoder (../src/p44-ledchain-encoder.h) in userspace and measures it
+ *  for every LED chip, layout, inversion and a range of chain lengths. Before measuring, it checks
+ *  the encoder output against reference frames and against the plain per-bit generateBits() path.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../src/p44-ledchain-encoder.h"
+
+#define MAX_LENGTHS 32
+#define MAX_LEDS 16384 // same as driver's LEDCHAIN_MAX_LEDS
+
+static const int defaultLengths[] = { 1, 10, 50, 100, 500, 1000, 4000, 16384 };
+
+typedef enum {
+  data_random,
+  data_black,
+  data_white,
+  data_gradient
+} DataKind_t;
+
+
+// reference frames with their expected encoder output (pattern count and checksum)
+typedef struct {
+  LedChip_t chip;
+  LedLayout_t layout;
+  int inverted;
+  int leds;
+  DataKind_t kind;
+  u32 numPatterns;
+  u32 checksum;
+} GoldenFrame_t;
+
+static const GoldenFrame_t goldenFrames[] = {
+  { ledchip_ws2811, ledlayout_rgb, 0, 100, data_random, 112, 0x21B994D3 },
+  { ledchip_ws2811, ledlayout_grbw, 1, 100, data_gradient, 150, 0xDE484D62 },
+  { ledchip_ws2812, ledlayout_grb, 0, 100, data_random, 95, 0xB6DF3811 },
+  { ledchip_ws2812, ledlayout_grb, 1, 100, data_random, 95, 0x1C73E705 },
+  { ledchip_ws2812, ledlayout_grb, 0, 1000, data_black, 750, 0x74463D50 },
+  { ledchip_ws2812, ledlayout_grb, 1, 1000, data_white, 1143, 0x4E5F9D4D },
+  { ledchip_ws2813, ledlayout_rgb, 0, 333, data_gradient, 311, 0xE61F491C },
+  { ledchip_ws2815, ledlayout_rgbw, 1, 333, data_random, 417, 0x1F89D40F },
+  { ledchip_p9823, ledlayout_rgb, 0, 100, data_white, 115, 0xE2D3BB36 },
+  { ledchip_p9823, ledlayout_grb, 1, 1000, data_random, 937, 0xEED5C442 },
+  { ledchip_sk6812, ledlayout_grbw, 0, 1000, data_black, 1000, 0xDC65AB34 },
+  { ledchip_sk6812, ledlayout_grbw, 1, 100, data_gradient, 124, 0xA7763E13 },
+};
+
+#define GOLDEN_MAX_PATTERNS 4
+
+// reference frames of two LEDs with their complete expected encoder output
+typedef struct {
+  LedChip_t chip;
+  LedLayout_t layout;
+  int inverted;
+  u32 numPatterns;
+  PWMPattern_t patterns[GOLDEN_MAX_PATTERNS];
+} GoldenPatterns_t;
+
+static const u8 goldenLedData[8] = { 0x12, 0x34, 0x56, 0x78, 0xFF, 0x00, 0x80, 0x01 }; // 2 LEDs RGB(W), as written to the device
+
+static const GoldenPatterns_t goldenPatterns[] = {
+  { ledchip_ws2812, ledlayout_grb, 0, 2, {
+    { { 0x56AAB5B5, 0x36B6B5AB }, 37250, 1 },
+    { { 0x6DB5B6DB, 0x00155555 }, 40000, 1 },
+  } },
+  { ledchip_ws2812, ledlayout_grb, 1, 2, {
+    { { 0xA9554A4A, 0xC9494A54 }, 37250, 1 },
+    { { 0x924A4924, 0xFFEAAAAA }, 40000, 1 },
+  } },
+  { ledchip_ws2811, ledlayout_rgb, 0, 3, {
+    { { 0xC92C9649, 0x16592596 }, 57200, 1 },
+    { { 0x496DB25B, 0x92DB6DB6 }, 51600, 1 },
+    { { 0x00001249, 0x00000000 }, 73300, 1 },
+  } },
+  { ledchip_sk6812, ledlayout_grbw, 1, 3, {
+    { { 0xA9554A4A, 0x25494A54 }, 34800, 1 },
+    { { 0x4AAAAAA4, 0x55492492 }, 34800, 1 },
+    { { 0xFFF2AAAA, 0xFFFFFFFF }, 51000, 1 },
+  } },
+};
+
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [-l leds[,leds...]] [-c chip] [-d random|black|white|gradient] [-t mS] [-q] [-x]\n", name);
+  fprintf(stderr, "  -l : chain lengths to measure (default: 1,10,50,100,500,1000,4000,16384)\n");
+  fprintf(stderr, "  -c : only measure given chip (WS2811, WS2812, WS2813, WS2815, P9823, SK6812)\n");
+  fprintf(stderr, "  -d : LED data to encode (default: random)\n");
+  fprintf(stderr, "  -t : min measuring time per case in mS (default: 200)\n");
+  fprintf(stderr, "  -q : no timing, only output pattern count and checksum of the encoder output (for comparing encoder versions)\n");
+  fprintf(stderr, "  -x : only check encoder output against reference frames and the per-bit encoder, no benchmark\n");
+  fprintf(stderr, "Output: CSV with chip,layout,inverted,leds,patterns,ns_per_led,ns_per_frame,checksum\n");
+  exit(1);
+}
+
+
+static long long nowNs(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+
+// deterministic LED data, so checksums are comparable between runs
+static void fillFrame(u8 *aFrame, int aBytes, DataKind_t aKind)
+{
+  u32 x = 0x2545F491; // xorshift32 state
+  int i;
+
+  for (i=0; i<aBytes; i++) {
+    switch (aKind) {
+      case data_black: aFrame[i] = 0; break;
+      case data_white: aFrame[i] = 0xFF; break;
+      case data_gradient: aFrame[i] = (u8)i; break;
+      default:
+        x ^= x<<13; x ^= x>>17; x ^= x<<5;
+        aFrame[i] = (u8)x;
+        break;
+    }
+  }
+}
+
+
+// FNV-1a over everything the driver sends: data words, nanosecs and repeat counts
+static u32 checksum(const PWMPattern_t *aPatterns, u32 aNumPatterns)
+{
+  u32 h = 2166136261u;
+  u32 w[4];
+  u32 i;
+  int k;
+
+  for (i=0; i<aNumPatterns; i++) {
+    w[0] = aPatterns[i].data[0];
+    w[1] = aPatterns[i].data[1];
+    w[2] = aPatterns[i].nanosecs;
+    w[3] = aPatterns[i].repeat;
+    for (k=0; k<16; k++) {
+      h ^= (w[k>>2]>>((k&3)*8)) & 0xFF;
+      h *= 16777619u;
+    }
+  }
+  return h;
+}
+
+
+// encode a frame with the per-bit generateBits() path (as the driver did before it used byte runs)
+static u32 encodePerBit(const u8 *aFrame, int aLeds, PatternBuffer_t *aBuf, LedEncoder_t *enc)
+{
+  int ncomp = enc->layout->channels;
+  int led;
+  int i;
+  int c;
+
+  initBitGenerator(aBuf, enc);
+  enc->firstChanged = 0;
+  for (led=0; led<aLeds; led++) {
+    for (i=0; i<ncomp; i++) {
+      c = enc->layout->fetchIdx[i];
+      generateBits(enc->lut[c][aFrame[led*ncomp+c]], 8, enc);
+    }
+  }
+  return finishEncoding(enc);
+}
+
+
+// check encoder output against the reference frames, returns number of mismatches
+static int checkGolden(u8 *aFrame, PatternBuffer_t *aBuf, LedEncoder_t *enc)
+{
+  const GoldenFrame_t *g;
+  const GoldenPatterns_t *gp;
+  u32 numPatterns;
+  u32 sum;
+  u32 i;
+  int errors = 0;
+
+  for (g = goldenFrames; g<goldenFrames+sizeof(goldenFrames)/sizeof(GoldenFrame_t); g++) {
+    enc->chip = &ledChipDescriptors[g->chip-1];
+    enc->layout = &ledLayoutDescriptors[g->layout-1];
+    enc->inverted = g->inverted;
+    fillFrame(aFrame, g->leds*enc->layout->channels, g->kind);
+    numPatterns = encodePatterns(aFrame, 0, g->leds, aBuf, enc);
+    sum = checksum(aBuf->patterns, numPatterns);
+    if (numPatterns!=g->numPatterns || sum!=g->checksum) {
+      fprintf(stderr, "%s/%s/%d: %d LEDs reference frame #%d: %u patterns, checksum %08X, expected %u, %08X\n",
+        enc->chip->name, enc->layout->name, enc->inverted, g->leds, (int)(g-goldenFrames),
+        numPatterns, sum, g->numPatterns, g->checksum
+      );
+      errors++;
+    }
+  }
+  for (gp = goldenPatterns; gp<goldenPatterns+sizeof(goldenPatterns)/sizeof(GoldenPatterns_t); gp++) {
+    enc->chip = &ledChipDescriptors[gp->chip-1];
+    enc->layout = &ledLayoutDescriptors[gp->layout-1];
+    enc->inverted = gp->inverted;
+    numPatterns = encodePatterns(goldenLedData, 0, 2, aBuf, enc);
+    if (numPatterns!=gp->numPatterns) {
+      fprintf(stderr, "%s/%s/%d: reference LEDs need %u patterns, expected %u\n",
+        enc->chip->name, enc->layout->name, enc->inverted, numPatterns, gp->numPatterns
+      );
+      errors++;
+      continue;
+    }
+    for (i=0; i<numPatterns; i++) {
+      if (memcmp(&aBuf->patterns[i], &gp->patterns[i], sizeof(PWMPattern_t))!=0) {
+        fprintf(stderr, "%s/%s/%d: reference LEDs pattern #%u is { { 0x%08X, 0x%08X }, %u, %u }, expected { { 0x%08X, 0x%08X }, %u, %u }\n",
+          enc->chip->name, enc->layout->name, enc->inverted, i,
+          aBuf->patterns[i].data[0], aBuf->patterns[i].data[1], aBuf->patterns[i].nanosecs, aBuf->patterns[i].repeat,
+          gp->patterns[i].data[0], gp->patterns[i].data[1], gp->patterns[i].nanosecs, gp->patterns[i].repeat
+        );
+        errors++;
+      }
+    }
+  }
+  return errors;
+}
+
+
+// check encoder output (complete and incremental) against the per-bit path for all chips, layouts and inversions,
+// returns number of mismatches
+static int checkPerBit(u8 *aFrame, PatternBuffer_t *aBuf, PatternBuffer_t *aRefBuf, LedEncoder_t *enc)
+{
+  static const int checkLengths[] = { 1, 2, 50, 333 };
+  int chip, layout, inverted, kind, li, leds, from, i;
+  u32 numPatterns, refPatterns;
+  int errors = 0;
+
+  for (chip=0; chip<num_ledchips-1; chip++) {
+    enc->chip = &ledChipDescriptors[chip];
+    for (layout=0; layout<num_ledlayouts-1; layout++) {
+      enc->layout = &ledLayoutDescriptors[layout];
+      for (inverted=0; inverted<2; inverted++) {
+        enc->inverted = inverted;
+        for (kind=data_random; kind<=data_gradient; kind++) {
+          for (li=0; li<(int)(sizeof(checkLengths)/sizeof(int)); li++) {
+            leds = checkLengths[li];
+            fillFrame(aFrame, leds*enc->layout->channels, kind);
+            numPatterns = encodePatterns(aFrame, 0, leds, aBuf, enc);
+            refPatterns = encodePerBit(aFrame, leds, aRefBuf, enc);
+            if (numPatterns!=refPatterns || checksum(aBuf->patterns, numPatterns)!=checksum(aRefBuf->patterns, refPatterns)) {
+              fprintf(stderr, "%s/%s/%d: %d LEDs encoded differently than per bit (%u instead of %u patterns)\n",
+                enc->chip->name, enc->layout->name, inverted, leds, numPatterns, refPatterns
+              );
+              errors++;
+            }
+            // re-encode from the middle and from the last LED with changed data, as partial updates do
+            for (from = leds/2; from>0 && from<leds; from = from<leds-1 ? leds-1 : leds) {
+              for (i=from*enc->layout->channels; i<leds*enc->layout->channels; i++) aFrame[i] ^= 0x5A;
+              numPatterns = encodePatterns(aFrame, from, leds, aBuf, enc);
+              refPatterns = encodePerBit(aFrame, leds, aRefBuf, enc);
+              if (numPatterns!=refPatterns || checksum(aBuf->patterns, numPatterns)!=checksum(aRefBuf->patterns, refPatterns)) {
+                fprintf(stderr, "%s/%s/%d: %d LEDs re-encoded from LED %d differently than per bit (%u instead of %u patterns)\n",
+                  enc->chip->name, enc->layout->name, inverted, leds, from, numPatterns, refPatterns
+                );
+                errors++;
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+  return errors;
+}
+
+
+int main(int argc, char **argv)
+{
+  int lengths[MAX_LENGTHS];
+  int numLengths = 0;
+  const char *chipName = NULL;
+  DataKind_t dataKind = data_random;
+  long long minTimeNs = 200000000LL;
+  int quick = 0;
+  int checkOnly = 0;
+  int opt;
+  char *p;
+  static u8 lut[4][256];
+  static u8 frame[MAX_LEDS*4];
+  static LedEncoder_t encoder;
+  PatternBuffer_t buf;
+  PatternBuffer_t exact;
+  PatternBuffer_t ref;
+  int chip, layout, inverted, li, leds, c, v;
+  u32 bufPatterns, numPatterns, exactPatterns, limit;
+  int ok;
+  long long start, elapsed;
+  long iterations;
+  int errors = 0;
+
+  while ((opt = getopt(argc, argv, "l:c:d:t:qx"))!=-1) {
+    switch (opt) {
+      case 'l':
+        for (p = optarg; *p && numLengths<MAX_LENGTHS; ) {
+          lengths[numLengths] = (int)strtol(p, &p, 10);
+          if (lengths[numLengths]<1 || lengths[numLengths]>MAX_LEDS) usage(argv[0]);
+          numLengths++;
+          if (*p==',') p++;
+          else if (*p) usage(argv[0]);
+        }
+        break;
+      case 'c': chipName = optarg; break;
+      case 'd':
+        if (strcmp(optarg, "random")==0) dataKind = data_random;
+        else if (strcmp(optarg, "black")==0) dataKind = data_black;
+        else if (strcmp(optarg, "white")==0) dataKind = data_white;
+        else if (strcmp(optarg, "gradient")==0) dataKind = data_gradient;
+        else usage(argv[0]);
+        break;
+      case 't': minTimeNs = atoll(optarg)*1000000LL; break;
+      case 'q': quick = 1; break;
+      case 'x': checkOnly = 1; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (numLengths==0) {
+    numLengths = sizeof(defaultLengths)/sizeof(int);
+    memcpy(lengths, defaultLengths, sizeof(defaultLengths));
+  }
+  // identity color correction, as without P44LEDCHAIN_IOC_SET_CORRECTION
+  for (c=0; c<4; c++) for (v=0; v<256; v++) lut[c][v] = v;
+  encoder.lut = (const u8 (*)[256])lut;
+  // reference buffer: room for twice the worst case of the longest chain, so exceeding maxPatterns() shows
+  bufPatterns = 2*maxPatterns(MAX_LEDS, 4, NULL);
+  buf.patterns = malloc(bufPatterns*sizeof(PWMPattern_t));
+  buf.ledBitPos = malloc(MAX_LEDS*sizeof(u32));
+  ref.patterns = malloc(bufPatterns*sizeof(PWMPattern_t));
+  ref.ledBitPos = malloc(MAX_LEDS*sizeof(u32));
+  if (!buf.patterns || !buf.ledBitPos || !ref.patterns || !ref.ledBitPos) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  encoder.bufPatterns = bufPatterns;
+  // encoder output must be exactly as before
+  errors += checkGolden(frame, &buf, &encoder);
+  errors += checkPerBit(frame, &buf, &ref, &encoder);
+  free(ref.patterns);
+  free(ref.ledBitPos);
+  if (checkOnly) {
+    free(buf.patterns);
+    free(buf.ledBitPos);
+    if (!errors) fprintf(stderr, "encoder output ok\n");
+    return errors ? 1 : 0;
+  }
+  fillFrame(frame, sizeof(frame), dataKind);
+  printf("chip,layout,inverted,leds,patterns,ns_per_led,ns_per_frame,checksum\n");
+  for (chip=0; chip<num_ledchips-1; chip++) {
+    if (chipName && strcasecmp(chipName, ledChipDescriptors[chip].name)!=0) continue;
+    encoder.chip = &ledChipDescriptors[chip];
+    for (layout=0; layout<num_ledlayouts-1; layout++) {
+      encoder.layout = &ledLayoutDescriptors[layout];
+      for (inverted=0; inverted<2; inverted++) {
+        encoder.inverted = inverted;
+        for (li=0; li<numLengths; li++) {
+          leds = lengths[li];
+          // reference run into the large buffer, also prepares the byte runs for this chip and inversion
+          encoder.bufPatterns = bufPatterns;
+          numPatterns = encodePatterns(frame, 0, leds, &buf, &encoder);
+          limit = maxPatterns(leds, encoder.layout->channels, encoder.chip);
+          if (numPatterns>limit) {
+            fprintf(stderr, "%s/%s: %d LEDs need %u patterns, more than maxPatterns()=%u\n",
+              encoder.chip->name, encoder.layout->name, leds, numPatterns, limit
+            );
+            errors++;
+          }
+          // same frame into a buffer of exactly maxPatterns() patterns, as the driver allocates it,
+          // which is also used for measuring
+          exact.patterns = malloc(limit*sizeof(PWMPattern_t));
+          exact.ledBitPos = malloc(leds*sizeof(u32));
+          if (!exact.patterns || !exact.ledBitPos) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+          }
+          encoder.bufPatterns = limit;
+          exactPatterns = encodePatterns(frame, 0, leds, &exact, &encoder);
+          ok = exactPatterns==numPatterns && checksum(exact.patterns, exactPatterns)==checksum(buf.patterns, numPatterns);
+          if (!ok) {
+            fprintf(stderr, "%s/%s: %d LEDs encoded into buffer of maxPatterns()=%u patterns differ (%u instead of %u patterns)\n",
+              encoder.chip->name, encoder.layout->name, leds, limit, exactPatterns, numPatterns
+            );
+            errors++;
+          }
+          elapsed = 0;
+          iterations = 0;
+          if (!quick && ok) {
+            start = nowNs();
+            do {
+              encodePatterns(frame, 0, leds, &exact, &encoder);
+              iterations++;
+              elapsed = nowNs()-start;
+            } while (elapsed<minTimeNs || iterations<3);
+          }
+          printf("%s,%s,%d,%d,%u,%.1f,%.0f,%08X\n",
+            encoder.chip->name, encoder.layout->name, inverted, leds, numPatterns,
+            iterations ? (double)elapsed/iterations/leds : 0.0,
+            iterations ? (double)elapsed/iterations : 0.0,
+            checksum(buf.patterns, numPatterns)
+          );
+          fflush(stdout);
+          free(exact.patterns);
+          free(exact.ledBitPos);
+        }
+      }
+    }
+  }
+  free(buf.patterns);
+  free(buf.ledBitPos);
+  return errors ? 1 : 0;
+}
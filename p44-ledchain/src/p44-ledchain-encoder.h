@@ -0,0 +1,553 @@
+/*
+ *  p44-ledchain-encoder.h - PWM pattern encoder of the p44-ledchain kernel module
+ *
+ *  Copyright (C) 2017-2021 Lukas Zeller <luz@plan44.ch>
+ *
+ *  This is free software, licensed under the GNU General Public License v2.
+ *  See /LICENSE for more information.
+ *
+ */
+
+#ifndef __P44_LEDCHAIN_ENCODER_H__
+#define __P44_LEDCHAIN_ENCODER_H__
+
+// The encoder converts LED data into the 64-bit PWM patterns sent by the driver. It does not depend
+// on the device or the PWM unit, so it also builds in userspace (for benchmarking and checking
+// encoder changes on a development machine, see ../bench).
+// Entry point is encodePatterns(), with the LED chip, layout, inversion and color correction
+// set in a LedEncoder_t.
+
+#ifdef __KERNEL__
+
+#include <linux/types.h>
+#include <linux/bitops.h> // hweight64()
+
+#else // __KERNEL__
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define hweight64(w) __builtin_popcountll(w)
+#ifndef max
+#define max(a,b) ((a)>(b) ? (a) : (b))
+#endif
+#define printk(...) fprintf(stderr, __VA_ARGS__)
+#define KERN_INFO ""
+#define KERN_WARNING ""
+#ifndef LOGPREFIX
+#define LOGPREFIX "p44-ledchain-encoder: "
+#endif
+// - PWM unit property the encoder depends on (see p44-ledchain-pwm.h)
+#define PWM_MAX_WAVENUM 0xFFFF
+
+#endif // __KERNEL__
+
+
+// === LED types and their parameters
+
+typedef struct {
+  const char *name; ///< name of the LED layout
+  int channels; ///< number of channels, 3 or 4
+  u8 fetchIdx[4]; ///< fetch indices - at what relative index to fetch bytes from input into output stream
+} LedLayoutDescriptor_t;
+
+typedef enum {
+  ledlayout_none, ///< if MSB of LEDCHAIN_PARAM_LEDTYPE is set to this, MSB=layout, LSB=chip
+  ledlayout_rgb,
+  ledlayout_grb,
+  ledlayout_rgbw,
+  ledlayout_grbw,
+  num_ledlayouts
+} LedLayout_t;
+
+static const LedLayoutDescriptor_t ledLayoutDescriptors[num_ledlayouts-1] = {
+  // RGB data order
+  { .name = "RGB", .channels = 3, .fetchIdx = { 0, 1, 2 } },
+  // GRB data order
+  { .name = "GRB", .channels = 3, .fetchIdx = { 1, 0, 2 } },
+  // RGBW data order
+  { .name = "RGBW", .channels = 4, .fetchIdx = { 0, 1, 2, 3 } },
+  // SK2812 - GRBW data order
+  { .name = "GRBW", .channels = 4, .fetchIdx = { 1, 0, 2, 3 } },
+};
+
+
+typedef struct {
+  const char *name; ///< name of the LED chip/timing set
+  int T0Active_nS; ///< active time for sending a zero bit, such that 2*T0Active_nS are a usable T1Active_nS
+  int TPassive_min_nS; ///< minimum time signal must be passive after an active phase
+  int T0Passive_double; ///< if set, for a 0 bit the passive time is doubled
+  int TPassive_max_nS; ///< max time signal can be passive without reset occurring
+  int TReset_nS; ///< time signal must be passive to reset chain
+} LedChipDescriptor_t;
+
+
+typedef enum {
+  ledchip_none,
+  ledchip_ws2811,
+  ledchip_ws2812,
+  ledchip_ws2813,
+  ledchip_ws2815,
+  ledchip_p9823,
+  ledchip_sk6812,
+  num_ledchips
+} LedChip_t;
+
+
+// Note: time resolution is 25nS (= MT7688 PWM max resolution)
+static const LedChipDescriptor_t ledChipDescriptors[num_ledchips-1] = {
+  {
+    .name = "WS2811",
+    // timing from datasheet:
+    // - T0H = 350ns..650nS
+    // - T0L = 1850ns..2150nS
+    // - T1H = 1050ns..1350nS
+    // - T1L = 1150ns..1450nS
+    // - TReset = >50µS
+    .T0Active_nS = 500, .TPassive_min_nS = 1200, .T0Passive_double = 1,
+    .TPassive_max_nS = 10000, .TReset_nS = 50000
+  },
+  {
+    .name = "WS2812",
+    // timing from datasheet:
+    // - T0H = 200ns..500nS
+    // - T0L = 750ns..1050nS (actual max is fortunately higher, ~10uS)
+    // - T1H = 750ns..1050nS
+    // - T1L = 200ns..500nS (actual max is fortunately higher, ~10uS)
+    // - TReset = >50µS
+    .T0Active_nS = 350, .TPassive_min_nS = 900, .T0Passive_double = 0,
+    .TPassive_max_nS = 10000, .TReset_nS = 50000
+  },
+  {
+    .name = "WS2813",
+    // timing from datasheet:
+    // - T0H = 300ns..450nS
+    // - T0L = 300ns..100000nS - NOTE: 300nS is definitely not working, we're using min 650nS instead (proven ok with 200 WS2813)
+    // - T1H = 750ns..1000nS
+    // - T1L = 300ns..100000nS - NOTE: 300nS is definitely not working, we're using min 650nS instead (proven ok with 200 WS2813)
+    // - TReset = >300µS
+    .T0Active_nS = 375, .TPassive_min_nS = 650, .T0Passive_double = 0,
+    .TPassive_max_nS = 40000, .TReset_nS = 300000
+  },
+  {
+    .name = "WS2815",
+    // timing from datasheet:
+    // - T0H = 300ns..450nS
+    // - T0L = 300ns..100000nS - NOTE: 300nS is definitely not working, we're using min 650nS instead (proven ok with 200 WS2813)
+    // - T1H = 750ns..1000nS
+    // - T1L = 300ns..100000nS - NOTE: 300nS is definitely not working, we're using min 650nS instead (proven ok with 200 WS2813)
+    // - TReset = >300µS
+    // - Note: T0L/T1L of more than 35µS can apparently cause single LEDs to reset and loose bits
+    .T0Active_nS = 375, .TPassive_min_nS = 650, .T0Passive_double = 0,
+    .TPassive_max_nS = 35000, .TReset_nS = 300000
+  },
+  {
+    .name = "P9823",
+    // timing from datasheet:
+    // - T0H = 200ns..500nS
+    // - T0L = 1210ns..1510nS
+    // - T1H = 1210ns..1510nS
+    // - T1L = 200ns..500nS
+    // - TReset = >50µS
+    // Note: the T0L and T1H seem to be wrong, using experimentally determined values
+    .T0Active_nS = 425, .TPassive_min_nS = 1000, .T0Passive_double = 0,
+    .TPassive_max_nS = 10000, .TReset_nS = 50000
+  },
+  {
+    .name = "SK6812",
+    // timing from datasheet:
+    // - T0H = 150ns..450nS
+    // - T0L = 750ns..1050nS (actual max is fortunately higher, ~15uS)
+    // - T1H = 450ns..750nS
+    // - T1L = 450ns..750nS (actual max is fortunately higher, ~15uS)
+    // - TReset = >50µS
+    .T0Active_nS = 300, .TPassive_min_nS = 900, .T0Passive_double = 0,
+    .TPassive_max_nS = 15000, .TReset_nS = 80000
+  },
+};
+
+
+// MARK: ===== PWM patterns
+
+// PWM pattern
+typedef struct {
+  u32 data[2];
+  u32 nanosecs;
+  u32 repeat; // number of identical patterns starting with this one that the PWM can send as repeated waves
+} PWMPattern_t;
+
+// precalculated PWM bit run for one input byte
+typedef struct {
+  u32 bits; ///< PWM bits, LSB first, already inverted if needed
+  u32 numBits; ///< number of PWM bits in the run
+  u32 nanosecs; ///< time the run takes to send
+} PWMByteRun_t;
+
+// PWM pattern buffer
+typedef struct {
+  PWMPattern_t *patterns; ///< the PWM patterns
+  int validLeds; ///< number of LEDs at the beginning of the most recent frame the patterns are valid for
+  int numLeds; ///< number of LEDs the patterns were generated for
+  const LedChipDescriptor_t *chipDesc; ///< LED chip the patterns were generated for
+  u32 *ledBitPos; ///< PWM bit position (pattern index*64 + bit number) where each LED's data starts
+  // for timed frames
+  u32 numPatterns; ///< number of patterns in the buffer
+  long long startAt; ///< CLOCK_MONOTONIC time in nS when sending should start
+  u32 frameId; ///< caller's frame id
+  long long submittedAt; ///< time when the frame was submitted by write() or ioctl
+} PatternBuffer_t;
+
+
+// encoder state
+typedef struct {
+  // configuration, set before calling encodePatterns()
+  const LedChipDescriptor_t *chip; ///< LED chip (timing) to generate patterns for
+  const LedLayoutDescriptor_t *layout; ///< LED layout (channels and their order in the output)
+  int inverted; ///< set to generate inverted signal
+  const u8 (*lut)[256]; ///< color correction, output value for every input value, per input channel (R,G,B,W)
+  u32 bufPatterns; ///< size of the pattern buffers in patterns
+  // pattern generator vars
+  PatternBuffer_t *outBuf; ///< buffer being generated
+  PWMPattern_t *outPtr;
+  u64 outBits;
+  u32 bitCount;
+  u32 nanosecs;
+  u32 firstChanged; ///< index of the first pattern (re)generated for the current frame
+  // PWM bit runs for every possible input byte value, valid for byteRunsChip and byteRunsInverted
+  const LedChipDescriptor_t *byteRunsChip;
+  int byteRunsInverted;
+  PWMByteRun_t byteRuns[256];
+} LedEncoder_t;
+
+
+// MARK: ===== pattern buffer sizing
+
+// max number of PWM bits generated for one LED data bit
+static u32 maxPWMBitsPerBit(const LedChipDescriptor_t *aChip)
+{
+  // 1-bit: two active PWM bits plus one passive bit
+  // 0-bit: one active PWM bit plus one passive bit, or two for chips needing double passive time
+  return max(2+1, 1+(aChip->T0Passive_double ? 2 : 1));
+}
+
+
+// max number of PWM patterns needed to send aNumLeds LEDs with aChannels channels
+// - aChip: the LED chip, NULL if it can change with every frame (variable mode)
+static u32 maxPatterns(int aNumLeds, int aChannels, const LedChipDescriptor_t *aChip)
+{
+  u32 bitsPerBit = 0;
+  int i;
+
+  if (aChip) {
+    bitsPerBit = maxPWMBitsPerBit(aChip);
+  }
+  else {
+    for (i=0; i<num_ledchips-1; i++) bitsPerBit = max(bitsPerBit, maxPWMBitsPerBit(&ledChipDescriptors[i]));
+  }
+  // a 1-bit must not start at the last PWM bit of a pattern, so worst case, every completed pattern
+  // carries only 63 PWM bits of data, and the last (not completed) one can still contain some
+  return (u32)aNumLeds*aChannels*8*bitsPerBit/63 + 1;
+}
+
+
+// MARK: ===== Generating new patterns
+
+#define VAR_DUMP 0
+
+// init generating bits into given buffer
+static void initBitGenerator(PatternBuffer_t *aBuf, LedEncoder_t *enc)
+{
+  enc->outBuf = aBuf;
+  enc->outPtr = aBuf->patterns; // start at beginning of buffer
+  enc->outBits = 0;
+  enc->bitCount = 0;
+  enc->nanosecs = 0;
+}
+
+
+// resume generating bits at given PWM bit position in a buffer already containing valid patterns up to that position
+static void resumeBitGenerator(PatternBuffer_t *aBuf, u32 aBitPos, LedEncoder_t *enc)
+{
+  u32 activeBits;
+
+  enc->outBuf = aBuf;
+  enc->outPtr = aBuf->patterns+(aBitPos>>6); // pattern to continue
+  enc->bitCount = aBitPos & 0x3F;
+  // - keep the already generated bits of that pattern
+  enc->outBits = (((u64)(enc->outPtr->data[1])<<32) | enc->outPtr->data[0]) & ((1ULL<<enc->bitCount)-1);
+  // - re-calculate time for these bits
+  activeBits = hweight64(enc->inverted ? ~enc->outBits & ((1ULL<<enc->bitCount)-1) : enc->outBits);
+  enc->nanosecs = activeBits*enc->chip->T0Active_nS + (enc->bitCount-activeBits)*enc->chip->TPassive_min_nS;
+}
+
+
+// store completed 64-bit pattern and advance to next
+static void completePattern(LedEncoder_t *enc)
+{
+  // safeguard
+  if (enc->outPtr-enc->outBuf->patterns>=enc->bufPatterns) {
+    printk(KERN_WARNING LOGPREFIX "output buffer exhausted (should not happen)\n");
+  }
+  else {
+    enc->outPtr->data[0] = (u32)(enc->outBits); // bits 0..31
+    enc->outPtr->data[1] = (u32)(enc->outBits>>32); // bits 32..63
+    enc->outPtr->nanosecs = enc->nanosecs;
+    (enc->outPtr)++;
+  }
+  enc->outBits = 0;
+  enc->nanosecs = 0;
+  enc->bitCount = 0;
+}
+
+
+// generate single bit into pattern buffer
+static void generateBit(int aBit, LedEncoder_t *enc)
+{
+  #if VAR_DUMP
+  printk(KERN_INFO LOGPREFIX "bit=%d, outPtr=0x%08X, bitCount=%d, outBits=0x%016llX, nanosecs=%d\n", aBit, (u32)(enc->outPtr), enc->bitCount, enc->outBits, enc->nanosecs);
+  #endif
+
+  if (aBit!=enc->inverted) {
+    // set output bit high
+    enc->outBits |= 1ULL<<enc->bitCount;
+  }
+  // update nanoseconds
+  if (aBit)
+    enc->nanosecs += enc->chip->T0Active_nS;
+  else
+    enc->nanosecs += enc->chip->TPassive_min_nS;
+  // next bit
+  (enc->bitCount)++;
+  if (enc->bitCount>=64) {
+    // 64 bit pattern complete
+    completePattern(enc);
+  }
+}
+
+
+// generate bit pattern to be fed into PWM engine from input data word
+static void generateBits(u32 aWord, u8 aNumBits, LedEncoder_t *enc)
+{
+  u32 inMask = 1L<<(aNumBits-1);
+  int bit;
+  while (aNumBits>0) {
+    // generate next bit
+    bit = (aWord & inMask) != 0;
+    // make sure 1-bit does not start at end of a 64-bit word
+    if (bit && (enc->bitCount==63)) {
+      // High bit starting at end of 64bit output word -> would fail because cut in two parts by idle period
+      generateBit(0, enc); // insert an extra inactive period, so High bit is in fresh 64-bit word
+    }
+    generateBit(1, enc); // first bit always high
+    if (bit) generateBit(1, enc); // generate a second high period for a high input bit
+    // idle period is only needed if not in a new pattern (pattern load time is assumed to be ALWAYS longer than minimal idle period!)
+    if (enc->bitCount!=0) {
+      generateBit(0, enc); // at least one low period is needed
+      if (!bit && enc->chip->T0Passive_double && enc->bitCount!=0) {
+        // 0-bit needs double passive time (but is not needed if we're at end of the pattern)
+        generateBit(0, enc); // add another low bit
+      }
+    }
+    // shift input bit mask to next bit
+    inMask = inMask>>1;
+    // bit done
+    aNumBits--;
+  }
+}
+
+
+// precalculate the PWM bit runs for all input byte values for the current LED chip and inversion
+// Note: runs are what generateBits() produces for a byte as long as the run does not cross
+//   a 64-bit pattern boundary (only there, 1-bits get shifted and trailing idle periods dropped)
+static void prepareByteRuns(LedEncoder_t *enc)
+{
+  const LedChipDescriptor_t *chip = enc->chip;
+  PWMByteRun_t *run;
+  int byte;
+  int b;
+  int pwmBits;
+
+  for (byte=0; byte<256; byte++) {
+    run = &enc->byteRuns[byte];
+    run->bits = 0;
+    run->numBits = 0;
+    run->nanosecs = 0;
+    for (b=7; b>=0; b--) {
+      // active period: one PWM bit for a 0, two PWM bits for a 1
+      pwmBits = (byte & (1<<b)) ? 2 : 1;
+      run->nanosecs += pwmBits*chip->T0Active_nS;
+      while (pwmBits-->0) {
+        if (!enc->inverted) run->bits |= 1L<<run->numBits;
+        run->numBits++;
+      }
+      // passive period: one PWM bit, two for a 0 when chip needs double passive time
+      pwmBits = (!(byte & (1<<b)) && chip->T0Passive_double) ? 2 : 1;
+      run->nanosecs += pwmBits*chip->TPassive_min_nS;
+      while (pwmBits-->0) {
+        if (enc->inverted) run->bits |= 1L<<run->numBits;
+        run->numBits++;
+      }
+    }
+  }
+  enc->byteRunsChip = chip;
+  enc->byteRunsInverted = enc->inverted;
+}
+
+
+// generate bit pattern for one input byte, using precalculated run when possible
+static void generateByte(u8 aByte, LedEncoder_t *enc)
+{
+  const PWMByteRun_t *run = &enc->byteRuns[aByte];
+
+  if (enc->bitCount+run->numBits<=64) {
+    // entire run fits into current pattern -> just append it
+    enc->outBits |= (u64)(run->bits)<<enc->bitCount;
+    enc->nanosecs += run->nanosecs;
+    enc->bitCount += run->numBits;
+    if (enc->bitCount>=64) {
+      // 64 bit pattern complete
+      completePattern(enc);
+    }
+  }
+  else {
+    // run crosses pattern boundary -> generate bit by bit to apply boundary rules
+    generateBits(aByte, 8, enc);
+  }
+}
+
+
+// finish bit generation, fill up last 64-bit PWM word
+static u32 finishBitGenerator(LedEncoder_t *enc)
+{
+  // fill up to next 64bit
+  if (enc->bitCount!=0) {
+    // fill rest of pattern with passive bits
+    if (enc->inverted) {
+      enc->outBits |= ~0ULL<<enc->bitCount;
+    }
+    enc->nanosecs += (64-enc->bitCount)*enc->chip->TPassive_min_nS;
+    // word full now, save nanosecs and advance
+    completePattern(enc);
+  }
+  // return number of new patterns
+  return enc->outPtr - enc->outBuf->patterns;
+}
+
+
+// check if a pattern can be sent repeatedly by the PWM
+// Note: between repeated waves there might be no load time, but the encoder relies on it as the passive period
+//   when a pattern ends with an active period, or cuts the double passive time of a 0-bit at the end of a pattern
+static int patternRepeatable(const PWMPattern_t *aPattern, LedEncoder_t *enc)
+{
+  u32 active = enc->inverted ? ~aPattern->data[1] : aPattern->data[1]; // bits 32..63, active periods set
+
+  if (active & 0x80000000) return 0; // ends with active period
+  if (enc->chip->T0Passive_double && (active & 0x60000000)==0x40000000) return 0; // 0-bit with single passive period at end
+  return 1;
+}
+
+
+// determine runs of identical patterns that can be sent as repeated waves
+// - aFirstChanged: index of first pattern (re)generated, runs only need updating from there backwards
+static void markRepeats(PatternBuffer_t *aBuf, u32 aFirstChanged, u32 aNumPatterns, LedEncoder_t *enc)
+{
+  PWMPattern_t *p;
+  u32 run = 0;
+  int i;
+
+  for (i=aNumPatterns-1; i>=0; i--) {
+    p = &aBuf->patterns[i];
+    if (run>0 && run<PWM_MAX_WAVENUM && p->data[0]==p[1].data[0] && p->data[1]==p[1].data[1] && patternRepeatable(p, enc))
+      run++; // same as next pattern, extends run
+    else
+      run = 1;
+    if (i<aFirstChanged && p->repeat==run) break; // runs of all patterns before are unchanged
+    p->repeat = run;
+  }
+}
+
+
+// start generating patterns for a frame of LED data into a buffer
+// - aFirstLed: first LED to generate, patterns of the LEDs before are valid in aBuf already
+// - returns first LED to generate with encodeLeds() (0 if no patterns could be re-used)
+static int beginEncoding(int aFirstLed, int aLeds, PatternBuffer_t *aBuf, LedEncoder_t *enc)
+{
+  if (aFirstLed>0 && aFirstLed<aLeds) {
+    // patterns for LEDs before aFirstLed are unchanged, only re-generate from aFirstLed onwards
+    resumeBitGenerator(aBuf, aBuf->ledBitPos[aFirstLed], enc);
+  }
+  else {
+    aFirstLed = 0;
+    initBitGenerator(aBuf, enc);
+  }
+  enc->firstChanged = enc->outPtr-aBuf->patterns;
+  if (enc->byteRunsChip!=enc->chip || enc->byteRunsInverted!=enc->inverted) {
+    // LED chip or inversion has changed, need new PWM bit runs
+    prepareByteRuns(enc);
+  }
+  aBuf->chipDesc = enc->chip;
+  aBuf->numLeds = aLeds;
+  return aFirstLed;
+}
+
+
+// generate patterns for LEDs aFromLed..aToLed-1 of a frame, continuing where the previous call left off
+static void encodeLeds(const u8 *aFrame, int aFromLed, int aToLed, LedEncoder_t *enc)
+{
+  PatternBuffer_t *buf = enc->outBuf;
+  int led;
+  int ncomp;
+  int i;
+  int c;
+  const u8 *inPtr;
+
+  ncomp = enc->layout->channels;
+  for (led=aFromLed; led<aToLed; led++) {
+    // remember where this LED's patterns start
+    buf->ledBitPos[led] = ((enc->outPtr-buf->patterns)<<6) + enc->bitCount;
+    inPtr = aFrame + led*ncomp;
+    for (i=0; i<ncomp; i++) {
+      c = enc->layout->fetchIdx[i];
+      generateByte(enc->lut[c][inPtr[c]], enc); // color corrected
+    }
+  }
+}
+
+
+// number of patterns at the beginning of the buffer that are completely generated so far
+// Note: repeat counts are only valid after finishEncoding()
+static inline u32 completedPatterns(LedEncoder_t *enc)
+{
+  return enc->outPtr - enc->outBuf->patterns;
+}
+
+
+// finish generating patterns for a frame
+// - returns number of patterns in the buffer
+static u32 finishEncoding(LedEncoder_t *enc)
+{
+  u32 numPatterns;
+
+  numPatterns = finishBitGenerator(enc);
+  // find runs of identical patterns
+  markRepeats(enc->outBuf, enc->firstChanged, numPatterns, enc);
+  return numPatterns;
+}
+
+
+// generate patterns for a frame of LED data into a buffer
+// - aFirstLed: first LED to generate, patterns of the LEDs before are valid in aBuf already
+// - returns number of patterns in aBuf
+static u32 encodePatterns(const u8 *aFrame, int aFirstLed, int aLeds, PatternBuffer_t *aBuf, LedEncoder_t *enc)
+{
+  aFirstLed = beginEncoding(aFirstLed, aLeds, aBuf, enc);
+  encodeLeds(aFrame, aFirstLed, aLeds, enc);
+  return finishEncoding(enc);
+}
+
+#endif // __P44_LEDCHAIN_ENCODER_H__
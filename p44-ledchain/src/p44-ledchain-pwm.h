@@ -0,0 +1,127 @@
+/*
+ *  p44-ledchain-pwm.h - PWM unit register map and access backends of the p44-ledchain kernel module
+ *
+ *  Copyright (C) 2017-2021 Lukas Zeller <luz@plan44.ch>
+ *
+ *  This is free software, licensed under the GNU General Public License v2.
+ *  See /LICENSE for more information.
+ *
+ */
+
+#ifndef __P44_LEDCHAIN_PWM_H__
+#define __P44_LEDCHAIN_PWM_H__
+
+// All access to the PWM unit goes through a backend, selected at build time:
+// - MT7688 hardware (default when building for MT7620/MT7628/MT7688 SoCs)
+// - simulated PWM unit (P44LEDCHAIN_PWMSIM=1), see p44-ledchain-pwmsim.h
+// Backend interface:
+// - u32 pwm_read(u32 aReg): read PWM register at offset aReg
+// - void pwm_write(u32 aValue, u32 aReg): write PWM register at offset aReg
+// - int pwm_init(irq_handler_t aHandler, void *aDevId): make PWM unit accessible and install aHandler for the PWM IRQ
+// - void pwm_exit(void *aDevId): remove IRQ handler and release the PWM unit
+// - void pwm_add_debugfs(struct dentry *aRoot): add backend specific debugfs entries
+
+// - register offsets
+#define PWM_ENABLE        0x000
+#define PWM_EN_STATUS     0x20C
+
+// - information about undocumented PWM IRQ in MT7628 found in Android kernel driver in
+//   mediatek-android-linux-kerneltree/drivers/misc/mediatek/pwm/mt8173/include/mach/mt_pwm_prv.h
+//   Note that the MZ8173/MT6595 PWM is more capable (DMA!) than the MT7688's, but IRQ seems to be
+//   the same
+#define PWM_INT_ENABLE    0x200 // 8 bits, two bits per channel (ch0=0/1, ch1=2/3), bit 0=PWM_IRQ_FINISH, bit 1=PWM_IRQ_UNDERFLOW
+#define PWM_INT_STATUS    0x204 // 8 bits, two bits per channel (ch0=0/1, ch1=2/3), bit 0=PWM_IRQ_FINISH, bit 1=PWM_IRQ_UNDERFLOW
+#define PWM_INT_ACK       0x208 // write 1 to acknowledge IRQ
+// - information derived from MT7623N datasheet
+#define PWM_IRQ_FINISH    0x01 // IRQ that happens when wave is done
+#define PWM_IRQ_UNDERFLOW 0x02 // IRQ that happens when new data can be written?
+
+#define PWM_CHAN(channel,reg) (0x10+((channel)*0x40)+(reg))
+#define NUM_DEVICES 4 // number of PWMS = number of devices
+// - PWM channel register offsets
+#define PWMCON			    0x00
+#define PWMHDUR			    0x04
+#define PWMLDUR			    0x08
+#define PWMGDUR			    0x0c
+#define PWMSENDDATA0	  0x20
+#define PWMSENDDATA1	  0x24
+#define PWMWAVENUM	    0x28
+#define PWMDWIDTH		    0x2c
+#define PWMTHRES		    0x30
+#define PWMSENDWAVENUM  0x34
+// - max number of waves the PWM can send from the same data (16 bit wave count)
+#define PWM_MAX_WAVENUM 0xFFFF
+// - size of the register block
+#define PWM_REGS_SIZE     0x210
+
+
+#if P44LEDCHAIN_PWMSIM
+
+#include "p44-ledchain-pwmsim.h"
+
+#else // P44LEDCHAIN_PWMSIM
+
+// MARK: ===== MT7688 hardware backend
+
+#define MT7688_PWM_BASE 0x10005000L
+#define MT7688_PWM_IRQ (8+26) // Undocumented in MT7688 datasheet, but is same as mentioned in MT7628 datasheet IRQ channel table (8=CPU IRQ offset, 26=IRQ number in interrupt controller)
+
+// - access to ioremapped PWM area
+static void __iomem *pwm_base; // set from ioremap()
+
+
+static inline u32 pwm_read(u32 aReg)
+{
+  return ioread32(pwm_base+aReg);
+}
+
+
+static inline void pwm_write(u32 aValue, u32 aReg)
+{
+  iowrite32(aValue, pwm_base+aReg);
+}
+
+
+static int pwm_init(irq_handler_t aHandler, void *aDevId)
+{
+  int err;
+
+  // map PWM registers
+  // TODO: should also do request_mem_region()
+  pwm_base = ioremap(MT7688_PWM_BASE, PWM_REGS_SIZE);
+  printk(KERN_INFO DEVICE_NAME": pwm_base=0x%08X\n", (u32)pwm_base);
+  // request the IRQ
+  // FIXME: for now, we just KNOW the IRQ
+  err = request_any_context_irq(
+    MT7688_PWM_IRQ,
+    aHandler,
+    IRQF_SHARED , // the IRQ is shared between all PWM channels
+    "pwm-irq",
+    aDevId // array of all 4 possible devices
+  );
+  if (err!=IRQC_IS_HARDIRQ) {
+    printk(KERN_WARNING LOGPREFIX "registering IRQ %d failed (or not hardIRQ) for PWM, err=%d\n", MT7688_PWM_IRQ, err);
+    iounmap(pwm_base);
+    return err<0 ? err : -EINVAL;
+  }
+  return 0;
+}
+
+
+static void pwm_exit(void *aDevId)
+{
+  // free the IRQ
+  free_irq(MT7688_PWM_IRQ, aDevId);
+  // unmap PWM
+  iounmap(pwm_base);
+}
+
+
+static inline void pwm_add_debugfs(struct dentry *aRoot)
+{
+  // nothing to add for the hardware
+}
+
+#endif // P44LEDCHAIN_PWMSIM
+
+#endif // __P44_LEDCHAIN_PWM_H__
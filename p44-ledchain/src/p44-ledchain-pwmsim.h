@@ -0,0 +1,328 @@
+/*
+ *  p44-ledchain-pwmsim.h - simulated MT7688 PWM unit backend of the p44-ledchain kernel module
+ *
+ *  Copyright (C) 2017-2021 Lukas Zeller <luz@plan44.ch>
+ *
+ *  This is free software, licensed under the GNU General Public License v2.
+ *  See /LICENSE for more information.
+ *
+ */
+
+// Included from p44-ledchain-pwm.h when building with P44LEDCHAIN_PWMSIM=1.
+// With this backend, the module builds and loads on any kernel (e.g. x86) to measure retry rates and
+// throughput under synthetic IRQ latency. The simulated PWM unit models what the driver relies on:
+// - a channel starts sending when its bit in PWM_ENABLE is set, taking the wave data from PWMSENDDATA0/1
+// - a wave of 64 bits takes PWMHDUR*25nS for every 1 bit and PWMLDUR*25nS for every 0 bit
+// - with PWMWAVENUM>0, that many waves are sent, then PWM_IRQ_FINISH is raised
+// - with PWMWAVENUM==0, waves are sent continuously, taking PWMSENDDATA0/1 anew at the start of every wave
+//   and raising PWM_IRQ_UNDERFLOW
+// - clearing the PWM_ENABLE bit aborts the current wave
+// Waves end at the right time (hrtimers), IRQs are delivered after a latency of simirqlatency plus a random
+// 0..simirqjitter nS, plus simirqspike nS for one in simirqspikerate IRQs. The waves sent are captured
+// into a ring buffer, readable at /sys/kernel/debug/ledchain/simwaves.
+
+#include <linux/random.h> // get_random_u32()
+
+static int simirqlatency = 5000;
+module_param(simirqlatency, int, 0644);
+MODULE_PARM_DESC(simirqlatency, "simulated PWM: min IRQ latency in nS");
+static int simirqjitter = 10000;
+module_param(simirqjitter, int, 0644);
+MODULE_PARM_DESC(simirqjitter, "simulated PWM: max random additional IRQ latency in nS");
+static int simirqspike = 0;
+module_param(simirqspike, int, 0644);
+MODULE_PARM_DESC(simirqspike, "simulated PWM: additional IRQ latency of a latency spike in nS");
+static int simirqspikerate = 0;
+module_param(simirqspikerate, int, 0644);
+MODULE_PARM_DESC(simirqspikerate, "simulated PWM: one in this many IRQs has a latency spike, 0=none");
+static int simcapture = 4096;
+module_param(simcapture, int, 0444);
+MODULE_PARM_DESC(simcapture, "simulated PWM: number of waves captured (all channels)");
+
+
+// captured wave
+typedef struct {
+  long long startedAt; ///< CLOCK_MONOTONIC time in nS when the wave started
+  u32 data[2]; ///< PWMSENDDATA0/1 the wave was sent from
+  u32 nanosecs; ///< duration of the wave
+  int channel; ///< PWM channel
+} PWMSimWave_t;
+
+// simulated PWM channel
+typedef struct {
+  struct hrtimer wavetimer; ///< fires at the end of the current wave
+  int running; ///< set while sending waves
+  u32 data[2]; ///< data of the current wave
+  long long waveStart; ///< time the current wave started
+  u32 waveNs; ///< duration of the current wave
+  u32 wavesLeft; ///< number of waves left including the current one, 0 = continuous
+} PWMSimChannel_t;
+
+static struct {
+  spinlock_t lock; ///< protects all simulated PWM state
+  u32 regs[PWM_REGS_SIZE/4];
+  PWMSimChannel_t chan[NUM_DEVICES];
+  // IRQ
+  irq_handler_t handler;
+  void *devId;
+  struct hrtimer irqtimer; ///< fires when a raised IRQ is delivered
+  int irqPending; ///< set while irqtimer is armed
+  u32 irqs; ///< number of IRQs delivered
+  u32 maxLatencyNs; ///< max latency injected
+  // waveform capture
+  PWMSimWave_t *capture;
+  u32 captureIdx; ///< next capture ring entry to write
+  u32 captured; ///< total number of waves captured
+} pwmsim;
+
+#define PWMSIM_REG(reg) pwmsim.regs[(reg)/4]
+
+
+// lock held! start a new wave on the channel with the data currently in the registers
+static void pwmsim_latchWave(int aCh, long long aStart)
+{
+  PWMSimChannel_t *c = &pwmsim.chan[aCh];
+  u32 ones;
+
+  c->data[0] = PWMSIM_REG(PWM_CHAN(aCh, PWMSENDDATA0));
+  c->data[1] = PWMSIM_REG(PWM_CHAN(aCh, PWMSENDDATA1));
+  ones = hweight32(c->data[0])+hweight32(c->data[1]);
+  c->waveNs = (ones*PWMSIM_REG(PWM_CHAN(aCh, PWMHDUR)) + (64-ones)*PWMSIM_REG(PWM_CHAN(aCh, PWMLDUR)))*25;
+  if (c->waveNs==0) c->waveNs = 64*25; // durations not set up, but prevent waves of no length
+  c->waveStart = aStart;
+}
+
+
+// lock held! record a completely sent wave
+static void pwmsim_captureWave(int aCh)
+{
+  PWMSimChannel_t *c = &pwmsim.chan[aCh];
+  PWMSimWave_t *w;
+
+  if (!pwmsim.capture) return;
+  w = &pwmsim.capture[pwmsim.captureIdx];
+  w->startedAt = c->waveStart;
+  w->data[0] = c->data[0];
+  w->data[1] = c->data[1];
+  w->nanosecs = c->waveNs;
+  w->channel = aCh;
+  pwmsim.captureIdx = (pwmsim.captureIdx+1) % simcapture;
+  pwmsim.captured++;
+}
+
+
+// lock held! let simulated time pass up to aNow on the channel
+static void pwmsim_advance(int aCh, long long aNow)
+{
+  PWMSimChannel_t *c = &pwmsim.chan[aCh];
+
+  while (c->running && aNow>=c->waveStart+c->waveNs) {
+    pwmsim_captureWave(aCh);
+    if (c->wavesLeft==0) {
+      // continuous: next wave from current register contents, which can be refilled from now on
+      pwmsim_latchWave(aCh, c->waveStart+c->waveNs);
+      PWMSIM_REG(PWM_INT_STATUS) |= PWM_IRQ_UNDERFLOW<<(aCh*2);
+    }
+    else if (--c->wavesLeft>0) {
+      // repeat same wave
+      c->waveStart += c->waveNs;
+    }
+    else {
+      // done
+      c->running = 0;
+      PWMSIM_REG(PWM_INT_STATUS) |= PWM_IRQ_FINISH<<(aCh*2);
+    }
+  }
+}
+
+
+// lock held! raise IRQ if any enabled IRQ status is set and no IRQ is pending delivery
+static void pwmsim_checkIrq(void)
+{
+  u32 latencyNs;
+
+  if (pwmsim.irqPending || !(PWMSIM_REG(PWM_INT_STATUS) & PWMSIM_REG(PWM_INT_ENABLE))) return;
+  latencyNs = simirqlatency;
+  if (simirqjitter>0) latencyNs += get_random_u32() % simirqjitter;
+  if (simirqspikerate>0 && get_random_u32() % simirqspikerate==0) latencyNs += simirqspike;
+  if (latencyNs>pwmsim.maxLatencyNs) pwmsim.maxLatencyNs = latencyNs;
+  pwmsim.irqPending = 1;
+  hrtimer_start(&pwmsim.irqtimer, ktime_set(0, latencyNs), HRTIMER_MODE_REL);
+}
+
+
+// lock held! (re)arm the wave timer of the channel for the end of the current wave
+static void pwmsim_armWaveTimer(int aCh)
+{
+  PWMSimChannel_t *c = &pwmsim.chan[aCh];
+
+  if (c->running) hrtimer_start(&c->wavetimer, ns_to_ktime(c->waveStart+c->waveNs), HRTIMER_MODE_ABS);
+}
+
+
+static enum hrtimer_restart pwmsim_wave_timer_func(struct hrtimer *timer)
+{
+  PWMSimChannel_t *c = container_of(timer, PWMSimChannel_t, wavetimer);
+  int ch = c-pwmsim.chan;
+  unsigned long irqflags;
+
+  spin_lock_irqsave(&pwmsim.lock, irqflags);
+  pwmsim_advance(ch, ktime_to_ns(ktime_get()));
+  // Note: restarting with hrtimer_start(), because a register write on another CPU might have restarted the timer already
+  pwmsim_armWaveTimer(ch);
+  pwmsim_checkIrq();
+  spin_unlock_irqrestore(&pwmsim.lock, irqflags);
+  return HRTIMER_NORESTART;
+}
+
+
+static enum hrtimer_restart pwmsim_irq_timer_func(struct hrtimer *timer)
+{
+  unsigned long irqflags;
+  int ch;
+
+  spin_lock_irqsave(&pwmsim.lock, irqflags);
+  pwmsim.irqPending = 0;
+  pwmsim.irqs++;
+  for (ch=0; ch<NUM_DEVICES; ch++) pwmsim_advance(ch, ktime_to_ns(ktime_get()));
+  spin_unlock_irqrestore(&pwmsim.lock, irqflags);
+  // deliver (without lock, handler accesses registers)
+  pwmsim.handler(0, pwmsim.devId);
+  // level triggered: status not acknowledged (or raised meanwhile) raises the IRQ again
+  spin_lock_irqsave(&pwmsim.lock, irqflags);
+  pwmsim_checkIrq();
+  spin_unlock_irqrestore(&pwmsim.lock, irqflags);
+  return HRTIMER_NORESTART;
+}
+
+
+static u32 pwm_read(u32 aReg)
+{
+  unsigned long irqflags;
+  u32 val;
+  int ch;
+
+  spin_lock_irqsave(&pwmsim.lock, irqflags);
+  if (aReg==PWM_INT_STATUS) {
+    // status is polled with IRQs disabled (and thus, timers blocked) in busy polling mode
+    for (ch=0; ch<NUM_DEVICES; ch++) pwmsim_advance(ch, ktime_to_ns(ktime_get()));
+  }
+  val = aReg<PWM_REGS_SIZE ? PWMSIM_REG(aReg) : 0;
+  spin_unlock_irqrestore(&pwmsim.lock, irqflags);
+  return val;
+}
+
+
+static void pwm_write(u32 aValue, u32 aReg)
+{
+  unsigned long irqflags;
+  long long now;
+  u32 changed;
+  int ch;
+
+  if (aReg>=PWM_REGS_SIZE) return;
+  spin_lock_irqsave(&pwmsim.lock, irqflags);
+  // waves that have ended by now took their data from the registers before this write
+  now = ktime_to_ns(ktime_get());
+  for (ch=0; ch<NUM_DEVICES; ch++) pwmsim_advance(ch, now);
+  if (aReg==PWM_INT_ACK) {
+    PWMSIM_REG(PWM_INT_STATUS) &= ~aValue;
+  }
+  else if (aReg==PWM_ENABLE) {
+    changed = PWMSIM_REG(PWM_ENABLE) ^ aValue;
+    PWMSIM_REG(PWM_ENABLE) = aValue;
+    for (ch=0; ch<NUM_DEVICES; ch++) {
+      if (!(changed & (1<<ch))) continue;
+      if (aValue & (1<<ch)) {
+        // start sending
+        pwmsim.chan[ch].running = 1;
+        pwmsim.chan[ch].wavesLeft = PWMSIM_REG(PWM_CHAN(ch, PWMWAVENUM));
+        pwmsim_latchWave(ch, now);
+        if (pwmsim.chan[ch].wavesLeft==0) PWMSIM_REG(PWM_INT_STATUS) |= PWM_IRQ_UNDERFLOW<<(ch*2); // data taken, can be refilled
+        pwmsim_armWaveTimer(ch);
+      }
+      else {
+        // stop sending, abort current wave
+        pwmsim.chan[ch].running = 0;
+        hrtimer_try_to_cancel(&pwmsim.chan[ch].wavetimer); // Note: timer function finds channel not running when it could not be cancelled
+      }
+    }
+  }
+  else {
+    PWMSIM_REG(aReg) = aValue;
+  }
+  pwmsim_checkIrq();
+  spin_unlock_irqrestore(&pwmsim.lock, irqflags);
+}
+
+
+static int pwm_init(irq_handler_t aHandler, void *aDevId)
+{
+  int ch;
+
+  if (simcapture<1) simcapture = 1;
+  memset(&pwmsim, 0, sizeof(pwmsim));
+  spin_lock_init(&pwmsim.lock);
+  pwmsim.handler = aHandler;
+  pwmsim.devId = aDevId;
+  hrtimer_init(&pwmsim.irqtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+  pwmsim.irqtimer.function = pwmsim_irq_timer_func;
+  for (ch=0; ch<NUM_DEVICES; ch++) {
+    hrtimer_init(&pwmsim.chan[ch].wavetimer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    pwmsim.chan[ch].wavetimer.function = pwmsim_wave_timer_func;
+  }
+  pwmsim.capture = vzalloc(simcapture*sizeof(PWMSimWave_t));
+  if (!pwmsim.capture) return -ENOMEM;
+  printk(KERN_INFO LOGPREFIX "using SIMULATED PWM unit, IRQ latency=%d+0..%dnS, spike=%dnS every %d IRQs\n", simirqlatency, simirqjitter, simirqspike, simirqspikerate);
+  return 0;
+}
+
+
+static void pwm_exit(void *aDevId)
+{
+  int ch;
+
+  for (ch=0; ch<NUM_DEVICES; ch++) hrtimer_cancel(&pwmsim.chan[ch].wavetimer);
+  hrtimer_cancel(&pwmsim.irqtimer);
+  vfree(pwmsim.capture);
+  pwmsim.capture = NULL;
+}
+
+
+// captured waves, oldest first
+// Note: not synchronized with capturing, waves sent while reading might show up partially updated
+static int pwmsim_waves_show(struct seq_file *m, void *v)
+{
+  u32 n;
+  u32 i;
+  const PWMSimWave_t *w;
+
+  n = pwmsim.captured<simcapture ? pwmsim.captured : simcapture;
+  seq_printf(m, "irqs=%u, max injected latency=%unS, waves captured=%u, shown=%u\n", pwmsim.irqs, pwmsim.maxLatencyNs, pwmsim.captured, n);
+  seq_printf(m, "channel started_ns data0 data1 duration_ns\n");
+  for (i=0; i<n; i++) {
+    w = &pwmsim.capture[(pwmsim.captureIdx+simcapture-n+i) % simcapture];
+    seq_printf(m, "%d %lld %08X %08X %u\n", w->channel, w->startedAt, w->data[0], w->data[1], w->nanosecs);
+  }
+  return 0;
+}
+
+
+static int pwmsim_waves_open(struct inode *inode, struct file *filp)
+{
+  return single_open(filp, pwmsim_waves_show, NULL);
+}
+
+
+static const struct file_operations pwmsim_waves_fops = {
+  .open = pwmsim_waves_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
+
+static void pwm_add_debugfs(struct dentry *aRoot)
+{
+  debugfs_create_file("simwaves", 0444, aRoot, NULL, &pwmsim_waves_fops);
+}
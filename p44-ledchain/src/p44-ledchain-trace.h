@@ -0,0 +1,95 @@
+/*
+ *  p44-ledchain-trace.h - tracepoints of the p44-ledchain kernel module
+ *
+ *  Copyright (C) 2017-2021 Lukas Zeller <luz@plan44.ch>
+ *
+ *  This is free software, licensed under the GNU General Public License v2.
+ *  See /LICENSE for more information.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM p44ledchain
+
+#if !defined(__P44_LEDCHAIN_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __P44_LEDCHAIN_TRACE_H__
+
+#include <linux/tracepoint.h>
+
+// All events carry the PWM channel, a pattern index or count, and a nanosecond value.
+// Enable them at runtime, e.g. with `trace-cmd record -e p44ledchain` or via
+// /sys/kernel/debug/tracing/events/p44ledchain/
+
+DECLARE_EVENT_CLASS(p44ledchain_pattern,
+  TP_PROTO(int channel, u32 pattern, u32 ns),
+  TP_ARGS(channel, pattern, ns),
+  TP_STRUCT__entry(
+    __field(int, channel)
+    __field(u32, pattern)
+    __field(u32, ns)
+  ),
+  TP_fast_assign(
+    __entry->channel = channel;
+    __entry->pattern = pattern;
+    __entry->ns = ns;
+  ),
+  TP_printk("ch=%d pattern=%u ns=%u", __entry->channel, __entry->pattern, __entry->ns)
+);
+
+// sending a frame (or a retry of it) starts: pattern = number of patterns in the frame, ns = time since the frame was submitted
+DEFINE_EVENT_PRINT(p44ledchain_pattern, p44ledchain_frame_start,
+  TP_PROTO(int channel, u32 pattern, u32 ns),
+  TP_ARGS(channel, pattern, ns),
+  TP_printk("ch=%d patterns=%u submitted=%unS ago", __entry->channel, __entry->pattern, __entry->ns)
+);
+
+// next pattern loaded into the PWM: pattern = index, ns = expected time to send it
+DEFINE_EVENT_PRINT(p44ledchain_pattern, p44ledchain_refill,
+  TP_PROTO(int channel, u32 pattern, u32 ns),
+  TP_ARGS(channel, pattern, ns),
+  TP_printk("ch=%d pattern=%u expected=%unS", __entry->channel, __entry->pattern, __entry->ns)
+);
+
+// PWM IRQ: pattern = index of the pattern just sent, ns = IRQ delay behind expected end of sending it
+DEFINE_EVENT_PRINT(p44ledchain_pattern, p44ledchain_irq_delay,
+  TP_PROTO(int channel, u32 pattern, u32 ns),
+  TP_ARGS(channel, pattern, ns),
+  TP_printk("ch=%d pattern=%u delay=%unS", __entry->channel, __entry->pattern, __entry->ns)
+);
+
+// IRQ delay too long, frame needs to be sent again: pattern = index, ns = IRQ delay
+DEFINE_EVENT_PRINT(p44ledchain_pattern, p44ledchain_retry,
+  TP_PROTO(int channel, u32 pattern, u32 ns),
+  TP_ARGS(channel, pattern, ns),
+  TP_printk("ch=%d pattern=%u delay=%unS", __entry->channel, __entry->pattern, __entry->ns)
+);
+
+// max retries reached, frame is given up: pattern = index, ns = IRQ delay
+DEFINE_EVENT_PRINT(p44ledchain_pattern, p44ledchain_give_up,
+  TP_PROTO(int channel, u32 pattern, u32 ns),
+  TP_ARGS(channel, pattern, ns),
+  TP_printk("ch=%d pattern=%u delay=%unS", __entry->channel, __entry->pattern, __entry->ns)
+);
+
+// start timer armed: pattern = number of patterns remaining to be sent (retry), ns = timer delay
+DEFINE_EVENT_PRINT(p44ledchain_pattern, p44ledchain_reset_timer,
+  TP_PROTO(int channel, u32 pattern, u32 ns),
+  TP_ARGS(channel, pattern, ns),
+  TP_printk("ch=%d remaining=%u delay=%unS", __entry->channel, __entry->pattern, __entry->ns)
+);
+
+// all patterns of a frame sent: pattern = number of patterns, ns = duration of the update including retries
+DEFINE_EVENT_PRINT(p44ledchain_pattern, p44ledchain_frame_complete,
+  TP_PROTO(int channel, u32 pattern, u32 ns),
+  TP_ARGS(channel, pattern, ns),
+  TP_printk("ch=%d patterns=%u duration=%unS", __entry->channel, __entry->pattern, __entry->ns)
+);
+
+#endif // __P44_LEDCHAIN_TRACE_H__
+
+// this part must be outside the include guard
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE p44-ledchain-trace
+#include <trace/define_trace.h>
@@ -12,6 +12,7 @@
 #include <linux/module.h>
 #include <linux/kernel.h> // printk()
 #include <linux/slab.h> // kzalloc()
+#include <linux/vmalloc.h> // vzalloc()
 #include <linux/uaccess.h> // copy_to_user()
 #include <linux/moduleparam.h>
 #include <linux/stat.h>
@@ -20,6 +21,8 @@
 #include <linux/string.h>
 
 #include <linux/sched.h>
+#include <linux/sched/signal.h> // signal_pending()
+#include <linux/preempt.h> // preempt_disable()
 #include <linux/spinlock.h>
 #include <linux/watchdog.h>
 #include <linux/ioctl.h>
@@ -28,6 +31,21 @@
 
 #include <linux/interrupt.h>
 #include <linux/irq.h>
+#include <linux/mutex.h>
+#include <linux/bitops.h> // hweight64()
+#include <linux/mm.h> // remap_pfn_range()
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h> // div_u64()
+#include <asm/io.h> // virt_to_phys()
+
+#include "p44-ledchain.h"
+
+// tracepoints for IRQ/timer sequence tracing at runtime, see p44-ledchain-trace.h
+#define CREATE_TRACE_POINTS
+#include "p44-ledchain-trace.h"
 
 
 // MARK: ===== Global Module definitions
@@ -46,12 +64,30 @@ MODULE_DESCRIPTION("PWM driver for WS281x, SK68xx type addressable smart led cha
 // v4 - reduce TPassive_max_nS for WS2813/15 to 40uS, more causes occasional flicker for WS2815 at least
 // v5 - add ledtype_ws2815_rgb
 // v6 - completely reworked led type handling, separate chip/layout parameters, variable mode with led type header in data
-#define P44LEDCHAIN_VERSION 6
-
-
-#define LEDCHAIN_MAX_LEDS 2048
+// v7 - double buffered, only re-generates changed LEDs, mmap() frame buffer with commit ioctl, binary stats ioctls, poll()/fsync(), blocking write,
+//      queue of timed frames, synchronized start of multiple chains, timing histograms in debugfs, tracepoints,
+//      maxTPassive/retries calibration, optional early refill on PWM underflow IRQ,
+//      hardware repetition of identical patterns, busy polling for short chains, color correction,
+//      compact input formats (palette, runs, XOR delta runs) in variable mode, partial updates,
+//      runtime reconfiguration, up to 16384 LEDs with pattern buffers sized for the chip's worst case,
+//      PWM access via backend, simulated PWM unit backend for running without MT7688 hardware,
+//      encoder separated to build in userspace for benchmarking, sending starts while the rest of the frame is still being encoded
+#define P44LEDCHAIN_VERSION 7
+
+
+#define LEDCHAIN_MAX_LEDS 16384
+#define LEDCHAIN_MAX_HEADER 256 // header length byte + max 255 header bytes
+#define LEDCHAIN_DEFAULT_FRAMEQUEUE 4 // default number of timed frames that can be queued
+#define LEDCHAIN_MAX_FRAMEQUEUE 16 // max number of timed frames that can be queued
+#define LEDCHAIN_PRESENTED_RECORDS 16 // number of timed frame presentation records kept
+#define LEDCHAIN_HIST_BUCKETS 16 // number of buckets in log2 scale timing histograms
 #define DEFAULT_MAX_RETRIES 3
 #define MIN_MAXTPASSIVE_NS 5000
+#define LEDCHAIN_MAX_POLL_LEDS 256 // max LEDs for busy polling (limits time with IRQs disabled to around 10mS)
+#define LEDCHAIN_POLL_TIMEOUT_NS 100000 // how long to wait beyond expected end of a wave in busy polling before considering PWM stuck
+#define LEDCHAIN_PIPELINE_CHUNK 32 // number of LEDs encoded at a time before making their patterns available to the sender
+#define LEDCHAIN_PIPELINE_MARGIN_NS 200000 // min lead of the encoder over the sender, on top of twice the estimated remaining encode time
+#define LEDCHAIN_PIPELINE_MAX_CHUNKS 16 // max number of chunks left to encode (with preemption disabled) when starting to send a pipelined frame
 
 #define LOGPREFIX DEVICE_NAME ": "
 
@@ -64,7 +100,8 @@ MODULE_DESCRIPTION("PWM driver for WS281x, SK68xx type addressable smart led cha
 #define LEDCHAIN_PARAM_LEDTYPE 2 // type of LEDs
 #define LEDCHAIN_PARAM_MAXRETRIES 3 // maximum number of retries in case of timing failures before giving up
 #define LEDCHAIN_PARAM_MAXTPASSIVE 4 // maximum number of retries in case of timing failures before giving up
-#define LEDCHAIN_PARAM_MAX_COUNT 5 // max number of params
+#define LEDCHAIN_PARAM_MAXPOLLLEDS 5 // frames with up to this number of LEDs are sent by busy polling with IRQs disabled
+#define LEDCHAIN_PARAM_MAX_COUNT 6 // max number of params
 
 
 // parameter array storage
@@ -77,7 +114,7 @@ int ledchain2_argc = 0;
 static unsigned int ledchain3[LEDCHAIN_PARAM_MAX_COUNT] __initdata;
 int ledchain3_argc = 0;
 
-#define LEDCHAIN_PARM_DESC " config: <inverted 0/1>,<numleds>[,<ledtype>[,<maxretries>[,<maxTpassive>]]]"
+#define LEDCHAIN_PARM_DESC " config: <inverted 0/1>,<numleds>[,<ledtype>[,<maxretries>[,<maxTpassive>[,<maxpollleds>]]]]"
 
 // parameter declarations
 module_param_array(ledchain0, int, &ledchain0_argc, 0000);
@@ -89,188 +126,34 @@ MODULE_PARM_DESC(ledchain2, "ledchain@PMW2" LEDCHAIN_PARM_DESC);
 module_param_array(ledchain3, int, &ledchain3_argc, 0000);
 MODULE_PARM_DESC(ledchain3, "ledchain@PWM3" LEDCHAIN_PARM_DESC);
 
+static int earlyrefill = 0;
+module_param(earlyrefill, int, 0444);
+MODULE_PARM_DESC(earlyrefill, "1 = experimental: load next pattern on PWM underflow IRQ while current pattern is still being sent");
 
-// MARK: ===== PWM unit hardware definitions
+static int hwrepeat = 1;
+module_param(hwrepeat, int, 0444);
+MODULE_PARM_DESC(hwrepeat, "1 = let PWM send runs of identical patterns by repeating the wave, without an IRQ for each (default), 0 = disable");
 
-// - register block
-#define MT7688_PWM_BASE 0x10005000L
-#define MT7688_PWM_SIZE 0x00000210L
-// - access to ioremapped PWM area
-void __iomem *pwm_base; // set from ioremap()
-#define PWM_ADDR(offset) (pwm_base+offset)
-#define PWM_ENABLE        PWM_ADDR(0)
-#define PWM_EN_STATUS     PWM_ADDR(0x20C)
-
-// - information about undocumented PWM IRQ in MT7628 found in Android kernel driver in
-//   mediatek-android-linux-kerneltree/drivers/misc/mediatek/pwm/mt8173/include/mach/mt_pwm_prv.h
-//   Note that the MZ8173/MT6595 PWM is more capable (DMA!) than the MT7688's, but IRQ seems to be
-//   the same
-#define PWM_INT_ENABLE    PWM_ADDR(0x200) // 8 bits, two bits per channel (ch0=0/1, ch1=2/3), bit 0=PWM_IRQ_FINISH, bit 1=PWM_IRQ_UNDERFLOW
-#define PWM_INT_STATUS    PWM_ADDR(0x204) // 8 bits, two bits per channel (ch0=0/1, ch1=2/3), bit 0=PWM_IRQ_FINISH, bit 1=PWM_IRQ_UNDERFLOW
-#define PWM_INT_ACK       PWM_ADDR(0x208) // write 1 to acknowledge IRQ
-// - information derived from MT7623N datasheet
-#define PWM_IRQ_FINISH    0x01 // IRQ that happens when wave is done
-#define PWM_IRQ_UNDERFLOW 0x02 // IRQ that happens when new data can be written?
-
-
-#define PWM_CHAN_OFFS(channel,reg) (0x10+((channel)*0x40)+(reg))
-#define PWM_CHAN(channel,reg) PWM_ADDR(PWM_CHAN_OFFS(channel,reg))
-#define NUM_DEVICES 4 // number of PWMS = number of devices
-// - PWM channel register offsets
-#define PWMCON			    0x00
-#define PWMHDUR			    0x04
-#define PWMLDUR			    0x08
-#define PWMGDUR			    0x0c
-#define PWMSENDDATA0	  0x20
-#define PWMSENDDATA1	  0x24
-#define PWMWAVENUM	    0x28
-#define PWMDWIDTH		    0x2c
-#define PWMTHRES		    0x30
-#define PWMSENDWAVENUM  0x34
-
-
-// set 1 to enable IRQ/TIMER sequence tracing
-#define SEQ_TRACING 0
-
-// receiver sequence debug macros
-#if SEQ_TRACING
-#define SEQ_TRACE_MAX 1000
-static char seq_traceinfo[SEQ_TRACE_MAX];
-int seq_trace_idx;
-#define SEQ_TRACE_CLEAR() { seq_traceinfo[0]=0; seq_trace_idx=0; }
-#define SEQ_TRACE(c) { if(seq_trace_idx<SEQ_TRACE_MAX-1) seq_traceinfo[seq_trace_idx++] = c; seq_traceinfo[seq_trace_idx] = 0; }
-#define SEQ_TRACE_SHOW() { printk(KERN_INFO LOGPREFIX "sequence trace = %s\n", seq_traceinfo); }
-#define SEQ_HEXBYTE(b) { char c; SEQ_TRACE('$'); c = ((b>>4)&0xF)+'0'; if (c>'9') c+=7; SEQ_TRACE(c); c = (b&0xF)+'0'; if (c>'9') c+=7; SEQ_TRACE(c); }
-#else
-#define SEQ_TRACE_CLEAR()
-#define SEQ_TRACE(c)
-#define SEQ_HEXBYTE(b)
-#define SEQ_TRACE_SHOW()
-#endif
-
-
-// === LED types and their parameters
+static int framequeue = LEDCHAIN_DEFAULT_FRAMEQUEUE;
+module_param(framequeue, int, 0444);
+MODULE_PARM_DESC(framequeue, "number of timed frames that can be queued per ledchain (0.." __stringify(LEDCHAIN_MAX_FRAMEQUEUE) ")");
 
-typedef struct {
-  const char *name; ///< name of the LED layout
-  int channels; ///< number of channels, 3 or 4
-  u8 fetchIdx[4]; ///< fetch indices - at what relative index to fetch bytes from input into output stream
-} LedLayoutDescriptor_t;
+static int pipeline = 1;
+module_param(pipeline, int, 0444);
+MODULE_PARM_DESC(pipeline, "1 = start sending a frame while the rest of it is still being encoded (default), 0 = disable");
 
-typedef enum {
-  ledlayout_none, ///< if MSB of LEDCHAIN_PARAM_LEDTYPE is set to this, MSB=layout, LSB=chip
-  ledlayout_rgb,
-  ledlayout_grb,
-  ledlayout_rgbw,
-  ledlayout_grbw,
-  num_ledlayouts
-} LedLayout_t;
-
-static const LedLayoutDescriptor_t ledLayoutDescriptors[num_ledlayouts-1] = {
-  // RGB data order
-  { .name = "RGB", .channels = 3, .fetchIdx = { 0, 1, 2 } },
-  // GRB data order
-  { .name = "GRB", .channels = 3, .fetchIdx = { 1, 0, 2 } },
-  // RGBW data order
-  { .name = "RGBW", .channels = 4, .fetchIdx = { 0, 1, 2, 3 } },
-  // SK2812 - GRBW data order
-  { .name = "GRBW", .channels = 4, .fetchIdx = { 1, 0, 2, 3 } },
-};
 
+// MARK: ===== PWM unit hardware definitions
 
-typedef struct {
-  const char *name; ///< name of the LED chip/timing set
-  int T0Active_nS; ///< active time for sending a zero bit, such that 2*T0Active_nS are a usable T1Active_nS
-  int TPassive_min_nS; ///< minimum time signal must be passive after an active phase
-  int T0Passive_double; ///< if set, for a 0 bit the passive time is doubled
-  int TPassive_max_nS; ///< max time signal can be passive without reset occurring
-  int TReset_nS; ///< time signal must be passive to reset chain
-} LedChipDescriptor_t;
+// register map and access to the PWM unit (MT7688 hardware or simulated)
+#include "p44-ledchain-pwm.h"
+// - time allowed to get first underflow IRQ after starting, before early refill is considered unsupported
+#define EARLY_REFILL_PROBE_NS 1000000
 
 
-typedef enum {
-  ledchip_none,
-  ledchip_ws2811,
-  ledchip_ws2812,
-  ledchip_ws2813,
-  ledchip_ws2815,
-  ledchip_p9823,
-  ledchip_sk6812,
-  num_ledchips
-} LedChip_t;
-
-
-// Note: time resolution is 25nS (= MT7688 PWM max resolution)
-static const LedChipDescriptor_t ledChipDescriptors[num_ledchips-1] = {
-  {
-    .name = "WS2811",
-    // timing from datasheet:
-    // - T0H = 350ns..650nS
-    // - T0L = 1850ns..2150nS
-    // - T1H = 1050ns..1350nS
-    // - T1L = 1150ns..1450nS
-    // - TReset = >50µS
-    .T0Active_nS = 500, .TPassive_min_nS = 1200, .T0Passive_double = 1,
-    .TPassive_max_nS = 10000, .TReset_nS = 50000
-  },
-  {
-    .name = "WS2812",
-    // timing from datasheet:
-    // - T0H = 200ns..500nS
-    // - T0L = 750ns..1050nS (actual max is fortunately higher, ~10uS)
-    // - T1H = 750ns..1050nS
-    // - T1L = 200ns..500nS (actual max is fortunately higher, ~10uS)
-    // - TReset = >50µS
-    .T0Active_nS = 350, .TPassive_min_nS = 900, .T0Passive_double = 0,
-    .TPassive_max_nS = 10000, .TReset_nS = 50000
-  },
-  {
-    .name = "WS2813",
-    // timing from datasheet:
-    // - T0H = 300ns..450nS
-    // - T0L = 300ns..100000nS - NOTE: 300nS is definitely not working, we're using min 650nS instead (proven ok with 200 WS2813)
-    // - T1H = 750ns..1000nS
-    // - T1L = 300ns..100000nS - NOTE: 300nS is definitely not working, we're using min 650nS instead (proven ok with 200 WS2813)
-    // - TReset = >300µS
-    .T0Active_nS = 375, .TPassive_min_nS = 650, .T0Passive_double = 0,
-    .TPassive_max_nS = 40000, .TReset_nS = 300000
-  },
-  {
-    .name = "WS2815",
-    // timing from datasheet:
-    // - T0H = 300ns..450nS
-    // - T0L = 300ns..100000nS - NOTE: 300nS is definitely not working, we're using min 650nS instead (proven ok with 200 WS2813)
-    // - T1H = 750ns..1000nS
-    // - T1L = 300ns..100000nS - NOTE: 300nS is definitely not working, we're using min 650nS instead (proven ok with 200 WS2813)
-    // - TReset = >300µS
-    // - Note: T0L/T1L of more than 35µS can apparently cause single LEDs to reset and loose bits
-    .T0Active_nS = 375, .TPassive_min_nS = 650, .T0Passive_double = 0,
-    .TPassive_max_nS = 35000, .TReset_nS = 300000
-  },
-  {
-    .name = "P9823",
-    // timing from datasheet:
-    // - T0H = 200ns..500nS
-    // - T0L = 1210ns..1510nS
-    // - T1H = 1210ns..1510nS
-    // - T1L = 200ns..500nS
-    // - TReset = >50µS
-    // Note: the T0L and T1H seem to be wrong, using experimentally determined values
-    .T0Active_nS = 425, .TPassive_min_nS = 1000, .T0Passive_double = 0,
-    .TPassive_max_nS = 10000, .TReset_nS = 50000
-  },
-  {
-    .name = "SK6812",
-    // timing from datasheet:
-    // - T0H = 150ns..450nS
-    // - T0L = 750ns..1050nS (actual max is fortunately higher, ~15uS)
-    // - T1H = 450ns..750nS
-    // - T1L = 450ns..750nS (actual max is fortunately higher, ~15uS)
-    // - TReset = >50µS
-    .T0Active_nS = 300, .TPassive_min_nS = 900, .T0Passive_double = 0,
-    .TPassive_max_nS = 15000, .TReset_nS = 80000
-  },
-};
+// === LED types and their parameters, PWM pattern encoder
+
+#include "p44-ledchain-encoder.h"
 
 
 // predefined chip/layout combinations (backwards compatible)
@@ -313,11 +196,13 @@ static const PredefLedTypeDescriptor_t predefLedTypeDescriptors[num_predef_ledty
 
 // MARK: ===== structs
 
-// PWM pattern
+// log2 scale histogram: bucket 0 counts values < 2^shift, bucket n values >= 2^(shift+n-1) and < 2^(shift+n),
+// last bucket counts all larger values
 typedef struct {
-  u32 data[2];
-  u32 nanosecs;
-} PWMPattern_t;
+  const char *name; ///< name and unit of the values
+  int shift; ///< log2 of upper limit of bucket 0
+  u32 counts[LEDCHAIN_HIST_BUCKETS];
+} Histogram_t;
 
 
 // device variables record
@@ -327,6 +212,8 @@ struct p44ledchain_dev {
   int pwm_channel;
   // - inverted signal?
   int inverted;
+  // - LED type as configured (module parameter or P44LEDCHAIN_IOC_SET_CONFIG)
+  u16 ledType;
   // - predefined LED chip and layout types
   LedChip_t chipType;
   LedLayout_t layoutType;
@@ -346,26 +233,88 @@ struct p44ledchain_dev {
   spinlock_t updatelock;
   // HR timer to restart sending
   struct hrtimer starttimer;
-  // output buffer
-  PWMPattern_t *outBuf;
-  u32 outBufSize;
-  // - buffer pointer for generating or sending
-  PWMPattern_t *outPtr;
-  // - number of 64-bit patterns in the Buffer (=entire chain data)
+  // mutex for preparing new data
+  struct mutex writelock;
+  // wait queue for writers waiting for pending patterns to get sent
+  wait_queue_head_t readywait;
+  // input buffer (data copied from userspace)
+  char *inBuf;
+  u32 inBufSize;
+  // frame buffer for mmap() access
+  u8 *mapBuf;
+  u32 mapBufSize;
+  int mapBufOrder; // page order of the mmap() frame buffer allocation
+  atomic_t mapCount; // number of user space mappings of the mmap() frame buffer
+  // most recent frame (LED data as last sent or pending to be sent)
+  u8 *frame;
+  int frameLeds; // number of LEDs in frame
+  const LedChipDescriptor_t *frameChipDesc; // LED chip frame is for
+  const LedLayoutDescriptor_t *frameLayoutDesc; // LED layout frame is for
+  int frameObscured; // set when timed frames were queued after the most recent frame, so the chain might not show it
+  // output buffers
+  PatternBuffer_t patternBufs[2+LEDCHAIN_MAX_FRAMEQUEUE];
+  int numPatternBufs; // number of allocated pattern buffers
+  u32 outBufSize; // size of each pattern buffer in bytes
+  u32 outBufPatterns; // size of each pattern buffer in patterns
+  u32 maxOutPatterns; // max number of patterns generated into a pattern buffer (peak usage)
+  PatternBuffer_t *sendBuf; // front buffer, being sent
+  PatternBuffer_t *genBuf; // back buffer, for generating new patterns (pending to be sent when nextPWMPatterns>0)
+  // - timed frames
+  PatternBuffer_t *queuedBufs[LEDCHAIN_MAX_FRAMEQUEUE]; // buffers queued for sending at their startAt time, ordered by startAt
+  int numQueued;
+  PatternBuffer_t *freeBufs[LEDCHAIN_MAX_FRAMEQUEUE]; // buffers available for timed frames
+  int numFree;
+  struct p44ledchain_presented presented[LEDCHAIN_PRESENTED_RECORDS]; // ring of presentation records of timed frames
+  int presentedIdx; // index of oldest record
+  int numPresented; // number of records not yet read
+  // - buffer pointer for sending
+  PWMPattern_t *sendPtr;
+  // - number of 64-bit patterns in sendBuf (=entire chain data)
   u32 numPWMPatterns;
-  u32 nextPWMPatterns; // next scheduled number of patterns
+  u32 nextPWMPatterns; // number of patterns pending in genBuf, 0 if none
   // - number of patterns left to send
   u32 remainingPWMPatterns;
-  // - pattern generator vars
-  u32 outMask;
-  u32 bitCount;
-  u32 nanosecs;
+  // - pattern generator
+  LedEncoder_t encoder;
+  // - color correction: output value for every input value, per input channel (R,G,B,W)
+  struct p44ledchain_correction correction; // as set by user
+  u8 lut[4][256];
+  // palette for palette indexed input format
+  struct p44ledchain_palette palette;
   // read index
   size_t read_idx;
   // timing
   int notReady; // set as long as no new send can be started
   long long expectedSentAt; // time when last 64bits are expected to be fully sent (checked in IRQ to detect timing violations)
   int sendRetries; // how many times sending was tried
+  int sendFailed; // set when last update was given up after maxSendRetries
+  // early refill (using underflow IRQ)
+  int earlyRefill; // set when next pattern is loaded on underflow IRQ while current pattern is still being sent
+  int underflowSeen; // set when an underflow IRQ was seen in early refill mode
+  int idleLoaded; // set when the final all-passive pattern is loaded
+  u32 loadedNs; // duration of the pattern (or run of repeated patterns) loaded into the PWM data registers
+  u32 min_refill_slack; // min time left before end of the current wave when refilling during last update
+  u32 refill_fallbacks; // number of times early refill turned out unsupported
+  // hardware repetition of identical patterns
+  int hwRepeat; // set when runs of identical patterns are sent by letting the PWM repeat the wave
+  u32 repeated; // number of patterns sent as repeated waves (without IRQ of their own)
+  // busy polling
+  int maxPollLeds; // frames with up to this number of LEDs are sent by busy polling with IRQs disabled, 0 = never
+  int polled; // set when current frame is sent by busy polling
+  u32 polled_frames; // number of frames (including retries) sent by busy polling
+  u32 last_irqoff_us; // time IRQs were disabled for sending the last polled frame
+  u32 max_irqoff_us; // max time IRQs were disabled for sending a polled frame
+  // pipelined encoding (sending starts before all patterns of the frame are encoded)
+  int pipelined; // set while the frame being sent is still being encoded, numPWMPatterns grows as patterns get encoded
+  int pipelineStalled; // set when the sender has caught up with the encoder, frame is resent when completely encoded
+  u32 encodeNsPerLed; // estimated encoder time per LED (peak, slowly decaying)
+  u32 encodedNs; // total time to send the patterns encoded so far in the pipelined frame
+  u32 sentNs; // total time to send the patterns loaded into the PWM so far in the pipelined frame
+  u32 pipelineMinLead; // min lead of the encoder over the sender in the pipelined frame
+  u32 pipelined_frames; // number of frames started before they were completely encoded
+  u32 pipeline_underruns; // number of times the sender caught up with the encoder (should not happen)
+  u32 last_lead_ns; // min lead of the encoder over the sender during the last pipelined frame
+  u32 min_lead_ns; // min lead of the encoder over the sender in all pipelined frames
   // statistics
   long long updateStartedAt; // time when last update was started
   u32 max_irq_delay; // max IRQ delay behind expectedSentAt that did NOT trigger a retry
@@ -375,18 +324,35 @@ struct p44ledchain_dev {
   u32 updates; // number of updates requested
   u32 retries; // number of retries
   u32 errors; // number of failed updates
-  u32 overruns; // number of updates which came while another update was still in progress
+  u32 overruns; // number of updates that were not completed because another update came in
+  u32 superseded; // number of updates never sent because an even newer update came in before sending could start
+  u32 skipped; // number of updates not sent because data was identical to previous update
   u32 last_update_us; // time it took for the last complete update
   u32 min_update_us; // min time for a complete update
   u32 max_update_us; // max time for a complete update
+  u32 timed_frames; // number of timed frames started
+  u32 last_lateness_ns; // how late the last timed frame started
+  u32 max_lateness_ns; // max lateness of a timed frame
+  // detailed timing statistics (debugfs)
+  struct dentry *debugfs_dir;
+  long long submittedAt; // time when the frame being prepared was submitted
+  Histogram_t hist_irq_delay; // IRQ delays behind expectedSentAt
+  Histogram_t hist_timeout_pattern; // pattern indices where timeouts happened
+  Histogram_t hist_encode; // time needed to generate patterns for a frame
+  Histogram_t hist_latency; // time from submitting a frame until the chain has latched it
+  u32 last_encode_ns; // time needed to generate patterns for the last frame
+  u32 max_encode_ns; // max time needed to generate patterns for a frame
+  u32 last_latency_us; // time from submitting the last frame until the chain has latched it
+  u32 max_latency_us; // max time from submitting a frame until the chain has latched it
+  // timing calibration result
+  u32 calibTPassiveNs; // calibrated maxTPassiveNs, 0 if not calibrated or calibration failed
+  u32 calibRetries; // calibrated maxSendRetries
 };
 typedef struct p44ledchain_dev *devPtr_t;
 
 
 // MARK: ===== static (module global) vars
 
-// the IRQ number of the PWM_EN_STATUS
-static int pwm_irq_no;
 
 // the device class
 static struct class *p44ledchain_class = NULL;
@@ -397,6 +363,22 @@ int p44ledchain_major;
 // the devices stored by PWM channel, as we need this to find back device in IRQ handler
 static devPtr_t p44ledchain_devices[NUM_DEVICES];
 
+// debugfs directory
+static struct dentry *p44ledchain_debugfs_root;
+
+// synchronized start of multiple channels
+static u32 pwm_sync_start; // channels whose PWM enable is held back to enable them all at once
+static u32 pwm_sync_enable; // channels to enable at once
+
+
+// count a value in a histogram
+static void histogramAdd(Histogram_t *aHist, u32 aValue)
+{
+  int b = fls(aValue>>aHist->shift);
+  if (b>=LEDCHAIN_HIST_BUCKETS) b = LEDCHAIN_HIST_BUCKETS-1;
+  aHist->counts[b]++;
+}
+
 
 
 // MARK: ===== PWM data sending
@@ -405,28 +387,66 @@ static devPtr_t p44ledchain_devices[NUM_DEVICES];
 static u32 sendNextPattern(devPtr_t dev);
 static void sendFirstPattern(devPtr_t dev);
 static void startSendingPatterns(devPtr_t dev);
+static void stopEarlyRefill(devPtr_t dev);
+static void sendPatternsPolled(devPtr_t dev);
 
 
 
-// IRQs blocked!
-u32 sendNextPattern(devPtr_t dev)
+// IRQs blocked! set next pattern to send into PWM data registers, returns nanosecs it will take, 0 if no patterns left
+// (or, in a pipelined frame, none encoded yet)
+// - aRepeat: if set, a run of identical patterns is sent at once by setting the PWM's wave count
+static u32 loadNextPattern(int aRepeat, devPtr_t dev)
 {
   u32 expectedNs = 0;
+  u32 waves = 1;
+  u32 lead;
 
-  SEQ_TRACE('p');
-  // disable PWM before setting new pattern (especially in case no more patterns follow!)
-  iowrite32(ioread32(PWM_ENABLE) & ~(1<<dev->pwm_channel), PWM_ENABLE);
   if (dev->remainingPWMPatterns>0) {
     // set new pattern to send
-    iowrite32(dev->outPtr->data[0], PWM_CHAN(dev->pwm_channel, PWMSENDDATA0)); // Upper 32 bits
-    iowrite32(dev->outPtr->data[1], PWM_CHAN(dev->pwm_channel, PWMSENDDATA1)); // Lower 32 bits
+    pwm_write(dev->sendPtr->data[0], PWM_CHAN(dev->pwm_channel, PWMSENDDATA0)); // Upper 32 bits
+    pwm_write(dev->sendPtr->data[1], PWM_CHAN(dev->pwm_channel, PWMSENDDATA1)); // Lower 32 bits
     // get nanoseconds
-    expectedNs = dev->outPtr->nanosecs;
+    expectedNs = dev->sendPtr->nanosecs;
+    if (aRepeat) {
+      // let PWM repeat the wave for identical patterns
+      waves = dev->sendPtr->repeat;
+      if (waves>dev->remainingPWMPatterns) waves = dev->remainingPWMPatterns;
+      pwm_write(waves, PWM_CHAN(dev->pwm_channel, PWMWAVENUM));
+      expectedNs *= waves;
+      dev->repeated += waves-1;
+    }
+    if (dev->pipelined) {
+      // how far the encoder is ahead of the sender
+      dev->sentNs += expectedNs;
+      lead = dev->encodedNs-dev->sentNs;
+      if (lead<dev->pipelineMinLead) dev->pipelineMinLead = lead;
+    }
+    trace_p44ledchain_refill(dev->pwm_channel, dev->sendPtr-dev->sendBuf->patterns, expectedNs);
     // next
-    (dev->outPtr)++;
-    (dev->remainingPWMPatterns)--;
-    iowrite32(ioread32(PWM_ENABLE) | (1<<dev->pwm_channel), PWM_ENABLE); // (re)enable PWM
-    SEQ_TRACE('s');
+    dev->sendPtr += waves;
+    dev->remainingPWMPatterns -= waves;
+  }
+  return expectedNs;
+}
+
+
+// IRQs blocked!
+u32 sendNextPattern(devPtr_t dev)
+{
+  u32 expectedNs;
+
+  // disable PWM before setting new pattern (especially in case no more patterns follow!)
+  pwm_write(pwm_read(PWM_ENABLE) & ~(1<<dev->pwm_channel), PWM_ENABLE);
+  // repeat counts are not valid before encoding is complete, and early refill needs continuous waves
+  expectedNs = loadNextPattern(dev->hwRepeat && !dev->pipelined && !dev->earlyRefill, dev);
+  if (expectedNs) {
+    if (pwm_sync_start & (1<<dev->pwm_channel)) {
+      // channel will be enabled together with others
+      pwm_sync_enable |= 1<<dev->pwm_channel;
+    }
+    else {
+      pwm_write(pwm_read(PWM_ENABLE) | (1<<dev->pwm_channel), PWM_ENABLE); // (re)enable PWM
+    }
   }
   return expectedNs; // 0 if done, >0 how many nSecs sending this wave will take
 }
@@ -436,60 +456,159 @@ u32 sendNextPattern(devPtr_t dev)
 void sendFirstPattern(devPtr_t dev)
 {
   u32 expectedNs;
+  u32 intEnable;
 
-  SEQ_TRACE('P');
   // start at beginning of data
-  dev->outPtr = dev->outBuf;
+  dev->sendPtr = dev->sendBuf->patterns;
   dev->remainingPWMPatterns = dev->numPWMPatterns;
+  dev->idleLoaded = 0;
+  dev->sentNs = 0;
+  trace_p44ledchain_frame_start(dev->pwm_channel, dev->numPWMPatterns, ktime_to_ns(ktime_get())-dev->sendBuf->submittedAt);
+  // - enable PWM IRQ(s)
+  intEnable = pwm_read(PWM_INT_ENABLE) & ~((PWM_IRQ_FINISH|PWM_IRQ_UNDERFLOW)<<(dev->pwm_channel*2)); // currently enabled PWM IRQs of other channels
+  dev->polled = dev->sendBuf->numLeds<=dev->maxPollLeds && !(pwm_sync_start & (1<<dev->pwm_channel)); // not in synchronized start, must wait for other chains
+  if (dev->polled) {
+    // short frame: send it entirely now, polling the finish status (IRQ is enabled only to get the status bit)
+    pwm_write(intEnable | (PWM_IRQ_FINISH<<(dev->pwm_channel*2)), PWM_INT_ENABLE);
+    pwm_write(1, PWM_CHAN(dev->pwm_channel, PWMWAVENUM)); // one single wave at a time (unless a run of identical patterns is repeated)
+    sendPatternsPolled(dev);
+    return;
+  }
+  if (dev->earlyRefill) {
+    // continuous waves, refill on underflow (finish only happens when continuous mode is not supported)
+    pwm_write(intEnable | ((PWM_IRQ_FINISH|PWM_IRQ_UNDERFLOW)<<(dev->pwm_channel*2)), PWM_INT_ENABLE);
+    pwm_write(0, PWM_CHAN(dev->pwm_channel, PWMWAVENUM)); // send waves until disabled
+  }
+  else {
+    pwm_write(intEnable | (PWM_IRQ_FINISH<<(dev->pwm_channel*2)), PWM_INT_ENABLE); // enable finish interrupt for this channel
+    pwm_write(1, PWM_CHAN(dev->pwm_channel, PWMWAVENUM)); // one single wave at a time (unless a run of identical patterns is repeated)
+  }
   // start
   expectedNs = sendNextPattern(dev);
+  dev->loadedNs = expectedNs; // including repeated waves, needed when start is synchronized with other chains
   if (expectedNs) {
     // something sent, update expected time
-    dev->expectedSentAt = ktime_to_ns(ktime_get())+expectedNs;
-    SEQ_TRACE('S');
+    if (dev->earlyRefill) {
+      // expected time is when the current wave started, loadedNs how long it takes
+      dev->expectedSentAt = ktime_to_ns(ktime_get());
+      if (!dev->underflowSeen) {
+        // make sure we notice when underflow IRQs do not work as expected
+        hrtimer_start(&dev->starttimer, ktime_set(0, EARLY_REFILL_PROBE_NS), HRTIMER_MODE_REL);
+      }
+    }
+    else {
+      dev->expectedSentAt = ktime_to_ns(ktime_get())+expectedNs;
+    }
   }
   else {
-    SEQ_TRACE('0');
     // nothing to send, no need to wait for chain to reset
     dev->numPWMPatterns = 0;
   }
 }
 
 
+// IRQs blocked! returns index of latest queued timed frame that is due at aNow, -1 if none
+static int dueQueuedIndex(long long aNow, devPtr_t dev)
+{
+  int i = -1;
+
+  while (i+1<dev->numQueued && dev->queuedBufs[i+1]->startAt<=aNow) i++;
+  return i;
+}
+
+
+// IRQs blocked! returns latest queued timed frame that is due at aNow (and removes it from the queue), NULL if none
+static PatternBuffer_t *takeDueQueued(long long aNow, devPtr_t dev)
+{
+  PatternBuffer_t *pb;
+  struct p44ledchain_presented *rec;
+  long long lateness;
+  int due;
+  int i;
+
+  due = dueQueuedIndex(aNow, dev);
+  if (due<0) return NULL;
+  // earlier frames that are also due already are outdated, drop them
+  for (i=0; i<due; i++) {
+    dev->freeBufs[dev->numFree++] = dev->queuedBufs[i];
+    dev->superseded++;
+  }
+  pb = dev->queuedBufs[due];
+  // remove from queue
+  dev->numQueued -= due+1;
+  for (i=0; i<dev->numQueued; i++) dev->queuedBufs[i] = dev->queuedBufs[i+due+1];
+  // record presentation
+  lateness = pb->startAt>0 ? aNow-pb->startAt : 0; // start time 0 means as soon as possible, never late
+  if (lateness>0xFFFFFFFF) lateness = 0xFFFFFFFF;
+  dev->timed_frames++;
+  dev->last_lateness_ns = lateness;
+  if (dev->last_lateness_ns>dev->max_lateness_ns) dev->max_lateness_ns = dev->last_lateness_ns;
+  if (dev->numPresented>=LEDCHAIN_PRESENTED_RECORDS) {
+    // ring full, overwrite oldest
+    dev->presentedIdx = (dev->presentedIdx+1) % LEDCHAIN_PRESENTED_RECORDS;
+    dev->numPresented--;
+  }
+  rec = &dev->presented[(dev->presentedIdx+dev->numPresented) % LEDCHAIN_PRESENTED_RECORDS];
+  rec->frame_id = pb->frameId;
+  rec->lateness_ns = dev->last_lateness_ns;
+  rec->started_ns = aNow;
+  dev->numPresented++;
+  return pb;
+}
+
+
 // IRQs blocked!
 void startSendingPatterns(devPtr_t dev)
 {
-  SEQ_TRACE('B');
-  dev->numPWMPatterns = dev->nextPWMPatterns;
-  dev->nextPWMPatterns = 0; // used now
+  PatternBuffer_t *pb;
+
+  // timed frames that are due have priority
+  pb = takeDueQueued(ktime_to_ns(ktime_get()), dev);
+  if (pb) {
+    // due timed frame becomes front, previous front buffer is free now
+    dev->freeBufs[dev->numFree++] = dev->sendBuf;
+    dev->sendBuf = pb;
+    dev->numPWMPatterns = pb->numPatterns;
+  }
+  else {
+    if (dev->nextPWMPatterns>0) {
+      // pending patterns in back buffer: swap buffers, back becomes front
+      pb = dev->sendBuf;
+      dev->sendBuf = dev->genBuf;
+      dev->genBuf = pb;
+    }
+    dev->numPWMPatterns = dev->nextPWMPatterns;
+    dev->nextPWMPatterns = 0; // used now
+  }
   // init the PWM
   // - disable the PWM
-  iowrite32(ioread32(PWM_ENABLE) & ~(1<<dev->pwm_channel), PWM_ENABLE); // disable PWM
+  pwm_write(pwm_read(PWM_ENABLE) & ~(1<<dev->pwm_channel), PWM_ENABLE); // disable PWM
   // - set up the PWM for new pattern
   if (dev->numPWMPatterns>0) {
-    u32 intEnable;
-    SEQ_TRACE('>');
+    // - timer might be armed for a timed frame's start, which is now postponed
+    hrtimer_try_to_cancel(&dev->starttimer);
     dev->updates++;
     dev->notReady = 1;
     dev->sendRetries = 0;
+    dev->sendFailed = 0;
     dev->last_timeout_ns = 0;
     dev->last_update_us = 0;
     dev->max_irq_delay = 0;
     dev->min_irq_delay = dev->maxTPassiveNs;
+    dev->min_refill_slack = 0xFFFFFFFF;
     dev->updateStartedAt = ktime_to_ns(ktime_get());
-    // - enable PWM IRQ
-    intEnable = ioread32(PWM_INT_ENABLE); // currently enabled PWM IRQs
-    SEQ_HEXBYTE(intEnable);
-    iowrite32(intEnable | (PWM_IRQ_FINISH<<(dev->pwm_channel*2)), PWM_INT_ENABLE); // enable underflow interrupt for this channel
     // - set up PWM for one output sequence
-    iowrite32(0x7E08 | (dev->inverted ? 0x0180 : 0x0000), PWM_CHAN(dev->pwm_channel, PWMCON)); // PWMxCON: New PWM mode, all 64 bits, idle&guard=inverted, 40Mhz clock, no clock dividing
-    iowrite32(dev->ledChipDesc->T0Active_nS/25, PWM_CHAN(dev->pwm_channel, dev->inverted ? PWMLDUR : PWMHDUR)); // bit active time
-    iowrite32(dev->ledChipDesc->TPassive_min_nS/25, PWM_CHAN(dev->pwm_channel, dev->inverted ? PWMHDUR : PWMLDUR)); // bit passive time
-    iowrite32(0, PWM_CHAN(dev->pwm_channel, PWMGDUR)); // no guard time
-    iowrite32(1, PWM_CHAN(dev->pwm_channel, PWMWAVENUM)); // one single wave at a time
+    pwm_write(0x7E08 | (dev->inverted ? 0x0180 : 0x0000), PWM_CHAN(dev->pwm_channel, PWMCON)); // PWMxCON: New PWM mode, all 64 bits, idle&guard=inverted, 40Mhz clock, no clock dividing
+    pwm_write(dev->sendBuf->chipDesc->T0Active_nS/25, PWM_CHAN(dev->pwm_channel, dev->inverted ? PWMLDUR : PWMHDUR)); // bit active time
+    pwm_write(dev->sendBuf->chipDesc->TPassive_min_nS/25, PWM_CHAN(dev->pwm_channel, dev->inverted ? PWMHDUR : PWMLDUR)); // bit passive time
+    pwm_write(0, PWM_CHAN(dev->pwm_channel, PWMGDUR)); // no guard time
     // - initiate sending
     sendFirstPattern(dev);
   }
+  else if (dev->numQueued>0 && !dev->notReady) {
+    // nothing to send now, start next timed frame when it is due
+    hrtimer_start(&dev->starttimer, ns_to_ktime(dev->queuedBufs[0]->startAt), HRTIMER_MODE_ABS);
+  }
 }
 
 
@@ -497,115 +616,313 @@ static enum hrtimer_restart p44ledchain_timer_func(struct hrtimer *timer)
 {
   devPtr_t dev = container_of(timer, struct p44ledchain_dev, starttimer);
   unsigned long irqflags;
+  long long latency;
 
   spin_lock_irqsave(&dev->updatelock, irqflags);
-  SEQ_TRACE(' ');
-  SEQ_TRACE('T');
-  SEQ_TRACE('0'+dev->pwm_channel);
   if (dev->notReady) {
-    SEQ_TRACE('!');
     // still in progress
-    if (dev->remainingPWMPatterns) {
-      // timer hitting in notReady with remaining patterns means we must retry entire sequence
+    if (dev->earlyRefill && !dev->underflowSeen && !dev->polled) {
+      // no underflow IRQ within probe time -> cannot refill early, restart in normal mode
+      stopEarlyRefill(dev);
       sendFirstPattern(dev);
     }
+    else if (dev->remainingPWMPatterns || dev->pipelined) {
+      // timer hitting in notReady with remaining (or not yet encoded) patterns means we must retry entire sequence
+      if (dev->nextPWMPatterns || dueQueuedIndex(ktime_to_ns(ktime_get()), dev)>=0) {
+        // - but newer patterns are already pending, so send these instead of retrying outdated ones
+        dev->overruns++;
+        startSendingPatterns(dev);
+      }
+      else {
+        sendFirstPattern(dev);
+      }
+    }
     else {
       // timer hitting in notReady with NO patterns left means we become ready now
       dev->notReady = 0;
+      if (!dev->sendFailed) {
+        // chain has latched the frame now
+        latency = ((ktime_to_ns(ktime_get())-dev->sendBuf->submittedAt)*131)>>17; // poor man's division by 1000
+        if (latency>0xFFFFFFFF) latency = 0xFFFFFFFF;
+        dev->last_latency_us = latency;
+        if (dev->last_latency_us>dev->max_latency_us) dev->max_latency_us = dev->last_latency_us;
+        histogramAdd(&dev->hist_latency, dev->last_latency_us);
+      }
       // if there are new patterns, start sending those now
       startSendingPatterns(dev);
     }
   }
-  SEQ_TRACE(' ');
+  else {
+    // timer hitting when ready means a timed frame is due
+    startSendingPatterns(dev);
+  }
   spin_unlock_irqrestore(&dev->updatelock, irqflags);
+  // pending patterns might have started sending, or device might be ready now
+  wake_up_interruptible(&dev->readywait);
   // done
   return HRTIMER_NORESTART;
 }
 
 
+// IRQs blocked! pattern was not refilled in time, retry or give up
+static void sendingTimedOut(u32 aIrqDelayNs, devPtr_t dev)
+{
+  // failure, needs retry
+  trace_p44ledchain_retry(dev->pwm_channel, dev->sendPtr-dev->sendBuf->patterns-1, aIrqDelayNs);
+  histogramAdd(&dev->hist_timeout_pattern, dev->sendPtr-dev->sendBuf->patterns-1);
+  dev->sendRetries++;
+  dev->retries++;
+  dev->last_timeout_ns = aIrqDelayNs;
+  if (dev->sendRetries>=dev->maxSendRetries) {
+    // give up, do not restart when timer hits
+    trace_p44ledchain_give_up(dev->pwm_channel, dev->sendPtr-dev->sendBuf->patterns-1, aIrqDelayNs);
+    dev->remainingPWMPatterns = 0; // do not attempt to send anything more
+    dev->pipelined = 0; // not even patterns still being encoded
+    dev->errors++; // count the errors
+    dev->sendFailed = 1; // same data must be sent again
+  }
+  // - start timer to either hold back next update or retry sending
+  trace_p44ledchain_reset_timer(dev->pwm_channel, dev->remainingPWMPatterns, (dev->sendBuf->chipDesc->TReset_nS)/2*3);
+  hrtimer_start(&dev->starttimer, ktime_set(0, (dev->sendBuf->chipDesc->TReset_nS)/2*3), HRTIMER_MODE_REL);
+}
+
+
+// IRQs blocked! all patterns sent
+static void sendingComplete(long long aNow, devPtr_t dev)
+{
+  // - completely and successfully written out
+  trace_p44ledchain_frame_complete(dev->pwm_channel, dev->numPWMPatterns, aNow-dev->updateStartedAt);
+  dev->numPWMPatterns = 0;
+  dev->last_update_us = ((aNow-dev->updateStartedAt)*131)>>17; // poor man's division by 1000: multiply by 2^17/1000, cut 17 LSBs
+  if (dev->last_update_us>dev->max_update_us) dev->max_update_us = dev->last_update_us;
+  if (dev->last_update_us<dev->min_update_us) dev->min_update_us = dev->last_update_us;
+  // - start timer to know when chain reset time is over and next update can be started immediately
+  trace_p44ledchain_reset_timer(dev->pwm_channel, 0, (dev->sendBuf->chipDesc->TReset_nS)/2*3);
+  hrtimer_start(&dev->starttimer, ktime_set(0, (dev->sendBuf->chipDesc->TReset_nS)/2*3), HRTIMER_MODE_REL);
+}
+
+
+// IRQs blocked! sender has caught up with the encoder in a pipelined frame (should not happen, as sending only
+// starts when the encoder is far enough ahead, but IRQ load might delay it), chain latches an incomplete frame,
+// which is resent when it is completely encoded (unless retries are exhausted)
+static void pipelineUnderrun(devPtr_t dev)
+{
+  trace_p44ledchain_retry(dev->pwm_channel, dev->sendPtr-dev->sendBuf->patterns, 0);
+  dev->pipeline_underruns++;
+  dev->sendRetries++;
+  dev->retries++;
+  if (dev->sendRetries>=dev->maxSendRetries) {
+    // give up, encoder will not resend the frame
+    trace_p44ledchain_give_up(dev->pwm_channel, dev->sendPtr-dev->sendBuf->patterns, 0);
+    dev->remainingPWMPatterns = 0; // do not attempt to send anything more
+    dev->pipelined = 0; // not even patterns still being encoded
+    dev->errors++; // count the errors
+    dev->sendFailed = 1; // same data must be sent again
+    // - start timer to hold back next update until chain has latched
+    trace_p44ledchain_reset_timer(dev->pwm_channel, 0, (dev->sendBuf->chipDesc->TReset_nS)/2*3);
+    hrtimer_start(&dev->starttimer, ktime_set(0, (dev->sendBuf->chipDesc->TReset_nS)/2*3), HRTIMER_MODE_REL);
+    return;
+  }
+  dev->pipelineStalled = 1;
+}
+
+
+// IRQs blocked! finish IRQ: previous pattern is completely sent, send next one
+static void refillAfterFinish(long long aNow, devPtr_t dev)
+{
+  u32 expectedNs;
+  u32 irq_delay_ns;
+
+  // check for timing failure
+  irq_delay_ns = aNow-dev->expectedSentAt;
+  histogramAdd(&dev->hist_irq_delay, irq_delay_ns);
+  trace_p44ledchain_irq_delay(dev->pwm_channel, dev->sendPtr-dev->sendBuf->patterns-1, irq_delay_ns);
+  if (irq_delay_ns > dev->maxTPassiveNs) {
+    sendingTimedOut(irq_delay_ns, dev);
+  }
+  else {
+    // send next
+    if (irq_delay_ns<dev->min_irq_delay) {
+      dev->min_irq_delay = irq_delay_ns;
+    }
+    else if (irq_delay_ns>dev->max_irq_delay) {
+      dev->max_irq_delay = irq_delay_ns;
+    }
+    expectedNs = sendNextPattern(dev);
+    if (expectedNs) {
+      // something to send, update expected time
+      dev->expectedSentAt = aNow+expectedNs;
+    }
+    else if (dev->pipelined) {
+      // next pattern is not encoded yet
+      pipelineUnderrun(dev);
+    }
+    else {
+      // nothing more to send
+      sendingComplete(aNow, dev);
+    }
+    // statistics
+    dev->irq_count++;
+  }
+}
+
+
+// IRQs blocked! underflow IRQ in early refill mode: the PWM has taken the loaded pattern and started sending it,
+// so next pattern can be loaded now, while the current one is still being sent
+static void refillEarly(long long aNow, devPtr_t dev)
+{
+  long long waveStart;
+  long long slack;
+  u32 irq_delay_ns;
+
+  if (!dev->underflowSeen) {
+    // early refill works, no need for the probe timer any more
+    dev->underflowSeen = 1;
+    hrtimer_try_to_cancel(&dev->starttimer);
+  }
+  if (dev->numPWMPatterns==0) return; // not sending
+  // expectedSentAt is when the current wave started
+  waveStart = dev->expectedSentAt;
+  irq_delay_ns = aNow-waveStart;
+  slack = waveStart+dev->loadedNs-aNow;
+  histogramAdd(&dev->hist_irq_delay, irq_delay_ns);
+  trace_p44ledchain_irq_delay(dev->pwm_channel, dev->sendPtr-dev->sendBuf->patterns-1, irq_delay_ns);
+  if (slack<=0) {
+    // too late, PWM has already started sending the current pattern again
+    pwm_write(pwm_read(PWM_ENABLE) & ~(1<<dev->pwm_channel), PWM_ENABLE); // disable PWM
+    sendingTimedOut(irq_delay_ns, dev);
+    return;
+  }
+  if (slack<dev->min_refill_slack) dev->min_refill_slack = slack;
+  if (irq_delay_ns<dev->min_irq_delay) dev->min_irq_delay = irq_delay_ns;
+  if (irq_delay_ns>dev->max_irq_delay) dev->max_irq_delay = irq_delay_ns;
+  dev->irq_count++;
+  if (dev->idleLoaded) {
+    // idle pattern has started, so the last pattern is completely sent
+    pwm_write(pwm_read(PWM_ENABLE) & ~(1<<dev->pwm_channel), PWM_ENABLE); // disable PWM
+    dev->idleLoaded = 0;
+    sendingComplete(waveStart, dev);
+    return;
+  }
+  // next wave will start when the current one ends
+  dev->expectedSentAt = waveStart+dev->loadedNs;
+  dev->loadedNs = loadNextPattern(0, dev); // wave count is 0 (continuous), no hardware repetition
+  if (dev->loadedNs==0 && dev->pipelined) {
+    // next pattern is not encoded yet, stop before the PWM repeats the current one
+    pwm_write(pwm_read(PWM_ENABLE) & ~(1<<dev->pwm_channel), PWM_ENABLE); // disable PWM
+    pipelineUnderrun(dev);
+    return;
+  }
+  if (dev->loadedNs==0) {
+    // last pattern is being sent, load an all-passive pattern so the chain sees only idle time after it
+    pwm_write(dev->inverted ? 0xFFFFFFFF : 0, PWM_CHAN(dev->pwm_channel, PWMSENDDATA0));
+    pwm_write(dev->inverted ? 0xFFFFFFFF : 0, PWM_CHAN(dev->pwm_channel, PWMSENDDATA1));
+    dev->loadedNs = 64*dev->sendBuf->chipDesc->TPassive_min_nS;
+    dev->idleLoaded = 1;
+  }
+}
+
+
+// IRQs blocked! send all patterns of the current frame by busy polling the PWM's finish status instead of waiting for IRQs
+static void sendPatternsPolled(devPtr_t dev)
+{
+  u32 finishBit = PWM_IRQ_FINISH<<(dev->pwm_channel*2);
+  long long startedAt;
+  long long now;
+  long long deadline;
+  u32 expectedNs;
+  u32 irqOffUs;
+
+  startedAt = ktime_to_ns(ktime_get());
+  pwm_write(finishBit, PWM_INT_ACK); // no stale status
+  expectedNs = sendNextPattern(dev);
+  now = startedAt;
+  while (expectedNs) {
+    deadline = now+expectedNs+LEDCHAIN_POLL_TIMEOUT_NS;
+    // wait for wave to finish
+    while (!(pwm_read(PWM_INT_STATUS) & finishBit)) {
+      now = ktime_to_ns(ktime_get());
+      if (now>deadline) break;
+    }
+    if (now>deadline) {
+      // PWM did not finish in time (should not happen)
+      pwm_write(pwm_read(PWM_ENABLE) & ~(1<<dev->pwm_channel), PWM_ENABLE); // disable PWM
+      sendingTimedOut(now-deadline+LEDCHAIN_POLL_TIMEOUT_NS, dev);
+      break;
+    }
+    // refill immediately
+    pwm_write(finishBit, PWM_INT_ACK);
+    expectedNs = sendNextPattern(dev);
+    now = ktime_to_ns(ktime_get());
+    if (!expectedNs) {
+      // all patterns sent
+      sendingComplete(now, dev);
+    }
+  }
+  // statistics
+  irqOffUs = ((now-startedAt)*131)>>17; // poor man's division by 1000
+  dev->polled_frames++;
+  dev->last_irqoff_us = irqOffUs;
+  if (irqOffUs>dev->max_irqoff_us) dev->max_irqoff_us = irqOffUs;
+}
+
+
+// IRQs blocked! early refill does not work as expected, fall back to refill after finish IRQ
+static void stopEarlyRefill(devPtr_t dev)
+{
+  pwm_write(pwm_read(PWM_ENABLE) & ~(1<<dev->pwm_channel), PWM_ENABLE); // disable PWM
+  hrtimer_try_to_cancel(&dev->starttimer); // probe timer
+  dev->earlyRefill = 0;
+  dev->refill_fallbacks++;
+  printk(KERN_WARNING LOGPREFIX "#%d: early refill using underflow IRQ does not work, falling back to refill after finish IRQ\n", dev->pwm_channel);
+}
+
+
 static irqreturn_t p44ledchain_pwm_interrupt(int irq, void *dev_id)
 {
   unsigned long irqflags;
   long long now;
-  u32 expectedNs;
   u32 irqStatus;
-  u32 irqMask;
-  u32 irq_delay_ns;
+  u32 chanStatus;
   int i;
   irqreturn_t ret = IRQ_NONE;
   devPtr_t dev;
 
   local_irq_save(irqflags);
-  SEQ_TRACE(' ');
-  SEQ_TRACE('I');
-  irqStatus = ioread32(PWM_INT_STATUS); // two bits per channel
-  SEQ_HEXBYTE(irqStatus);
+  irqStatus = pwm_read(PWM_INT_STATUS); // two bits per channel
   now = ktime_to_ns(ktime_get());
-  irqMask = PWM_IRQ_FINISH;
   for (i=0; i<NUM_DEVICES; i++) {
     // IRQ from this PWM?
-    if (irqStatus & irqMask) {
-      SEQ_TRACE('i');
+    chanStatus = (irqStatus>>(i*2)) & (PWM_IRQ_FINISH|PWM_IRQ_UNDERFLOW);
+    if (chanStatus) {
       dev = ((devPtr_t *)dev_id)[i];
       if (dev) {
-        SEQ_TRACE('d');
-        SEQ_TRACE('0'+i);
         // PWM channel i has interrupt and we have a ledchain device for that channel
-        // - acknowledge the IRQ
-        iowrite32(irqMask, PWM_INT_ACK);
-        // check for timing failure
-        irq_delay_ns = now-dev->expectedSentAt;
-        if (irq_delay_ns > dev->maxTPassiveNs) {
-          // failure, needs retry
-          SEQ_TRACE('o');
-          dev->sendRetries++;
-          dev->retries++;
-          dev->last_timeout_ns = irq_delay_ns;
-          if (dev->sendRetries>=dev->maxSendRetries) {
-            // give up, do not restart when timer hits
-            SEQ_TRACE('E');
-            dev->remainingPWMPatterns = 0; // do not attempt to send anything more
-            dev->errors++; // count the errors
+        // Note: on SMP (simulated PWM), the status might have been consumed by busy polling on another CPU meanwhile
+        spin_lock(&dev->updatelock);
+        chanStatus &= pwm_read(PWM_INT_STATUS)>>(i*2);
+        if (chanStatus) {
+          // - acknowledge the IRQ
+          pwm_write(chanStatus<<(i*2), PWM_INT_ACK);
+          if (dev->earlyRefill) {
+            if (chanStatus & PWM_IRQ_FINISH) {
+              // wave finished, so PWM does not send continuously -> cannot refill early, restart in normal mode
+              stopEarlyRefill(dev);
+              sendFirstPattern(dev);
+            }
+            else {
+              refillEarly(now, dev);
+            }
           }
-          // - start timer to either hold back next update or retry sending
-          hrtimer_start(&dev->starttimer, ktime_set(0, (dev->ledChipDesc->TReset_nS)/2*3), HRTIMER_MODE_REL);
-        }
-        else {
-          // send next
-          SEQ_TRACE('n');
-          if (irq_delay_ns<dev->min_irq_delay) {
-            dev->min_irq_delay = irq_delay_ns;
-          }
-          else if (irq_delay_ns>dev->max_irq_delay) {
-            dev->max_irq_delay = irq_delay_ns;
-          }
-          expectedNs = sendNextPattern(dev);
-          if (expectedNs) {
-            // something to send, update expected time
-            dev->expectedSentAt = now+expectedNs;
-            SEQ_TRACE('w');
+          else if (chanStatus & PWM_IRQ_FINISH) {
+            refillAfterFinish(now, dev);
           }
-          else {
-            // nothing more to send
-            SEQ_TRACE('W');
-            // - completely and successfully written out
-            dev->numPWMPatterns = 0;
-            dev->last_update_us = ((now-dev->updateStartedAt)*131)>>17; // poor man's division by 1000: multiply by 2^17/1000, cut 17 LSBs
-            if (dev->last_update_us>dev->max_update_us) dev->max_update_us = dev->last_update_us;
-            if (dev->last_update_us<dev->min_update_us) dev->min_update_us = dev->last_update_us;
-            // - start timer to know when chain reset time is over and next update can be started immediately
-            hrtimer_start(&dev->starttimer, ktime_set(0, (dev->ledChipDesc->TReset_nS)/2*3), HRTIMER_MODE_REL);
-          }
-          // statistics
-          dev->irq_count++;
         }
+        spin_unlock(&dev->updatelock);
         ret = IRQ_HANDLED;
       }
     }
-    // next PWM channel
-    irqMask <<= 2;
   }
-  SEQ_TRACE(' ');
   local_irq_restore(irqflags);
   // return handled status
   return ret;
@@ -622,25 +939,38 @@ static int stopSendingPatterns(devPtr_t dev)
   unsigned long irqflags;
 
   spin_lock_irqsave(&dev->updatelock, irqflags);
-  SEQ_TRACE('X');
   nrdy = dev->notReady;
-  SEQ_TRACE('0'+nrdy);
   // prevent any more pattern sending
   dev->remainingPWMPatterns = 0;
   dev->numPWMPatterns = 0;
   dev->nextPWMPatterns = 0;
+  dev->pipelined = 0;
   // now when IRQ or timer hits, nothing will happen except notReady cleared
   spin_unlock_irqrestore(&dev->updatelock, irqflags);
   return nrdy;
 }
 
 
-// Call when new patterns are ready in the buffer to be sent
+// Call before preparing new patterns into the back buffer, returns number of patterns that were pending there
+static u32 takePendingPatterns(devPtr_t dev)
+{
+  u32 pending;
+  unsigned long irqflags;
+
+  spin_lock_irqsave(&dev->updatelock, irqflags);
+  // back buffer is no longer pending, so it will not be swapped in while we modify it
+  pending = dev->nextPWMPatterns;
+  dev->nextPWMPatterns = 0;
+  spin_unlock_irqrestore(&dev->updatelock, irqflags);
+  return pending;
+}
+
+
+// Call when new patterns are ready in the back buffer to be sent
 static void scheduleNewPatterns(u32 aNumNewPatterns, devPtr_t dev)
 {
   unsigned long irqflags;
 
-  SEQ_TRACE('N');
   spin_lock_irqsave(&dev->updatelock, irqflags);
   // set number of new patterns
   dev->nextPWMPatterns = aNumNewPatterns;
@@ -665,134 +995,302 @@ static int isReady(devPtr_t dev)
 }
 
 
-// MARK: ===== Generating new patterns
+// Call when new patterns are ready in the back buffers of multiple chains to start sending them at the same time
+// - aNewPatterns: number of new patterns per channel
+static void startSendingGroup(u32 aChannels, int *aNewPatterns)
+{
+  devPtr_t dev;
+  unsigned long irqflags;
+  long long now;
+  int allReady = 1;
+  int ch;
+
+  local_irq_save(irqflags);
+  for (ch=0; ch<NUM_DEVICES; ch++) {
+    if (!(aChannels & (1<<ch))) continue;
+    dev = p44ledchain_devices[ch];
+    spin_lock_nested(&dev->updatelock, ch);
+    dev->nextPWMPatterns = aNewPatterns[ch];
+    // Note: a chain might have started a timed frame meanwhile
+    if (dev->notReady) allReady = 0;
+  }
+  // prepare all chains, but hold back enabling the PWMs when all chains can start now
+  // (otherwise, start individually, as soon as possible)
+  if (allReady) pwm_sync_start = aChannels;
+  pwm_sync_enable = 0;
+  for (ch=0; ch<NUM_DEVICES; ch++) {
+    if (!(aChannels & (1<<ch))) continue;
+    dev = p44ledchain_devices[ch];
+    if (!dev->notReady) startSendingPatterns(dev);
+  }
+  if (pwm_sync_enable) {
+    // enable all PWMs at once
+    pwm_write(pwm_read(PWM_ENABLE) | pwm_sync_enable, PWM_ENABLE);
+    // timing of first pattern starts now
+    now = ktime_to_ns(ktime_get());
+    for (ch=0; ch<NUM_DEVICES; ch++) {
+      if (!(pwm_sync_enable & (1<<ch))) continue;
+      dev = p44ledchain_devices[ch];
+      dev->expectedSentAt = dev->earlyRefill ? now : now+dev->loadedNs; // early refill: time wave started
+      dev->updateStartedAt = now;
+    }
+  }
+  pwm_sync_start = 0;
+  pwm_sync_enable = 0;
+  for (ch=NUM_DEVICES-1; ch>=0; ch--) {
+    if (aChannels & (1<<ch)) spin_unlock(&p44ledchain_devices[ch]->updatelock);
+  }
+  local_irq_restore(irqflags);
+}
 
-#define VAR_DUMP 0
 
-// init generating bits
-static void initBitGenerator(devPtr_t dev)
+// returns true if there are no patterns pending to be sent (so new ones would not supersede them)
+static int canTakeNewPatterns(devPtr_t dev)
 {
-  dev->remainingPWMPatterns = 0; // nothing ready to send yet, will also halt currently running send
-  dev->outPtr = dev->outBuf; // start at beginning of buffer
-  dev->outMask = 0;
-  dev->bitCount = 0;
-  dev->nanosecs = 0;
+  u32 pending;
+  unsigned long irqflags;
+
+  spin_lock_irqsave(&dev->updatelock, irqflags);
+  pending = dev->nextPWMPatterns;
+  spin_unlock_irqrestore(&dev->updatelock, irqflags);
+  return pending==0;
 }
 
 
-// generate single bit into pattern buffer
-static void generateBit(int aBit, devPtr_t dev)
+// returns true if all patterns are sent and chain reset time is over
+static int isIdle(devPtr_t dev)
 {
-  u32 om = dev->outMask;
-  u32 *owPtr = &(dev->outPtr->data[(dev->bitCount & 0x20) ? 1 : 0]); // second word for bits 32..63
+  int idle;
+  unsigned long irqflags;
+
+  spin_lock_irqsave(&dev->updatelock, irqflags);
+  idle = !dev->notReady && dev->nextPWMPatterns==0 && dev->numQueued==0;
+  spin_unlock_irqrestore(&dev->updatelock, irqflags);
+  return idle;
+}
 
-  #if VAR_DUMP
-  printk(KERN_INFO LOGPREFIX "bit=%d, outPtr=0x%08X, om=0x%08X, bitCount=%d, *owPtr=0x%08X, nanosecs=%d\n", aBit, (u32)(dev->outPtr), om, dev->bitCount, *owPtr, dev->nanosecs);
-  #endif
 
-  if (om==0) {
-    om=1L; // fill LSB first
-    *owPtr = 0; // init next buffer word
+// wait until new patterns can be taken without superseding pending ones
+static int waitForNewPatterns(struct file *filp, devPtr_t dev)
+{
+  if (filp->f_flags & O_NONBLOCK) {
+    return canTakeNewPatterns(dev) ? 0 : -EAGAIN;
   }
-  if (aBit!=dev->inverted) {
-    // set output bit high
-    *owPtr = *owPtr | om;
+  return wait_event_interruptible(dev->readywait, canTakeNewPatterns(dev));
+}
+
+
+// wait until all patterns are sent and chain reset time is over
+static int waitForIdle(struct file *filp, devPtr_t dev)
+{
+  if (filp->f_flags & O_NONBLOCK) {
+    return isIdle(dev) ? 0 : -EAGAIN;
   }
-  else {
-    // set output bit low
-    *owPtr = *owPtr & ~om;
-  }
-  // update nanoseconds
-  if (aBit)
-    dev->nanosecs += dev->ledChipDesc->T0Active_nS;
-  else
-    dev->nanosecs += dev->ledChipDesc->TPassive_min_nS;
-  // next bit
-  om = om << 1;
-  (dev->bitCount)++;
-  if (om==0) {
-    // longword complete, begin next
-    if (dev->bitCount>=64) {
-      // 64 bit pattern complete, save nanoseconds
-      dev->outPtr->nanosecs = dev->nanosecs;
-      dev->nanosecs = 0;
-      dev->bitCount = 0;
-      // safeguard
-      if (dev->outPtr-dev->outBuf>=dev->outBufSize) {
-        printk(KERN_WARNING LOGPREFIX "output buffer exhaused (should not happen)\n");
-      }
-      else {
-        (dev->outPtr)++;
-      }
-    }
+  return wait_event_interruptible(dev->readywait, isIdle(dev));
+}
+
+
+// returns true if a buffer is available for queuing a timed frame
+static int canQueueFrame(devPtr_t dev)
+{
+  int numFree;
+  unsigned long irqflags;
+
+  spin_lock_irqsave(&dev->updatelock, irqflags);
+  numFree = dev->numFree;
+  spin_unlock_irqrestore(&dev->updatelock, irqflags);
+  return numFree>0;
+}
+
+
+// wait until a buffer is available for queuing a timed frame
+static int waitForQueueSpace(struct file *filp, devPtr_t dev)
+{
+  if (framequeue<=0) return -EOPNOTSUPP;
+  if (filp->f_flags & O_NONBLOCK) {
+    return canQueueFrame(dev) ? 0 : -EAGAIN;
   }
-  dev->outMask = om;
+  return wait_event_interruptible(dev->readywait, canQueueFrame(dev));
 }
 
 
-// generate bit pattern to be fed into PWM engine from input data word
-static void generateBits(u32 aWord, u8 aNumBits, devPtr_t dev)
+// Call with a buffer containing the patterns for a timed frame to queue it for sending at its startAt time
+static void queueNewPatterns(PatternBuffer_t *aBuf, devPtr_t dev)
 {
-  u32 inMask = 1L<<(aNumBits-1);
-  int bit;
-  while (aNumBits>0) {
-    // generate next bit
-    bit = (aWord & inMask) != 0;
-    // make sure 1-bit does not start at end of a 64-bit word
-    if (bit && (dev->bitCount==63)) {
-      // High bit starting at end of 64bit output word -> would fail because cut in two parts by idle period
-      generateBit(0, dev); // insert an extra inactive period, so High bit is in fresh 64-bit word
-    }
-    generateBit(1, dev); // first bit always high
-    if (bit) generateBit(1, dev); // generate a second high period for a high input bit
-    // idle period is only needed if not in a new pattern (pattern load time is assumed to be ALWAYS longer than minimal idle period!)
-    if (dev->bitCount!=0) {
-      generateBit(0, dev); // at least one low period is needed
-      if (!bit && dev->ledChipDesc->T0Passive_double && dev->bitCount!=0) {
-        // 0-bit needs double passive time (but is not needed if we're at end of the pattern)
-        generateBit(0, dev); // add another low bit
+  unsigned long irqflags;
+  int i;
+
+  spin_lock_irqsave(&dev->updatelock, irqflags);
+  // insert ordered by start time, after frames with the same start time
+  for (i=dev->numQueued; i>0 && dev->queuedBufs[i-1]->startAt>aBuf->startAt; i--) {
+    dev->queuedBufs[i] = dev->queuedBufs[i-1];
+  }
+  dev->queuedBufs[i] = aBuf;
+  dev->numQueued++;
+  if (!dev->notReady) {
+    // fully ready: start now if due, otherwise (re)arm timer for the earliest timed frame
+    // (otherwise, timer will initiate it when reset time is over)
+    startSendingPatterns(dev);
+  }
+  spin_unlock_irqrestore(&dev->updatelock, irqflags);
+}
+
+
+// get oldest not yet read presentation record of a timed frame, returns 0 if none
+static int getPresented(struct p44ledchain_presented *aPresented, devPtr_t dev)
+{
+  int found = 0;
+  unsigned long irqflags;
+
+  spin_lock_irqsave(&dev->updatelock, irqflags);
+  if (dev->numPresented>0) {
+    *aPresented = dev->presented[dev->presentedIdx];
+    dev->presentedIdx = (dev->presentedIdx+1) % LEDCHAIN_PRESENTED_RECORDS;
+    dev->numPresented--;
+    found = 1;
+  }
+  spin_unlock_irqrestore(&dev->updatelock, irqflags);
+  return found;
+}
+
+
+// MARK: ===== Generating new patterns
+
+// configure the encoder for the device's current LED type and color correction
+static void setupEncoder(devPtr_t dev)
+{
+  dev->encoder.chip = dev->ledChipDesc;
+  dev->encoder.layout = dev->ledLayoutDesc;
+  dev->encoder.inverted = dev->inverted;
+  dev->encoder.lut = (const u8 (*)[256])dev->lut;
+  dev->encoder.bufPatterns = dev->outBufPatterns;
+}
+
+
+// generate patterns for a frame of LED data into a buffer, with the device's current LED type and color correction
+// - aFirstLed: first LED to generate, patterns of the LEDs before are valid in aBuf already
+// - returns number of patterns in aBuf
+static u32 generatePatterns(const u8 *aFrame, int aFirstLed, int aLeds, PatternBuffer_t *aBuf, devPtr_t dev)
+{
+  u32 numPatterns;
+
+  setupEncoder(dev);
+  numPatterns = encodePatterns(aFrame, aFirstLed, aLeds, aBuf, &dev->encoder);
+  if (numPatterns>dev->maxOutPatterns) dev->maxOutPatterns = numPatterns;
+  return numPatterns;
+}
+
+
+// start sending the first aPatterns encoded patterns of the frame in the back buffer while the rest is still being encoded
+// - aEncodedNs: time it takes to send these patterns
+// - returns 0 if the chain is not ready to start a new frame now
+static int startPipelined(u32 aPatterns, u32 aEncodedNs, devPtr_t dev)
+{
+  unsigned long irqflags;
+  int started = 0;
+
+  spin_lock_irqsave(&dev->updatelock, irqflags);
+  if (!dev->notReady && dev->numQueued==0) {
+    dev->pipelined = 1;
+    dev->pipelineStalled = 0;
+    dev->pipelineMinLead = 0xFFFFFFFF;
+    dev->encodedNs = aEncodedNs;
+    dev->nextPWMPatterns = aPatterns;
+    startSendingPatterns(dev);
+    started = 1;
+  }
+  spin_unlock_irqrestore(&dev->updatelock, irqflags);
+  return started;
+}
+
+
+// make more encoded patterns of the pipelined frame available to the sender
+// - aPatterns: number of patterns encoded so far
+// - aEncodedNs: time it takes to send them
+// - aComplete: set when the frame is completely encoded
+static void extendPipelined(u32 aPatterns, u32 aEncodedNs, int aComplete, devPtr_t dev)
+{
+  unsigned long irqflags;
+  u32 lead;
+
+  spin_lock_irqsave(&dev->updatelock, irqflags);
+  // Note: sending might have been given up meanwhile
+  if (dev->pipelined) {
+    dev->remainingPWMPatterns += aPatterns-dev->numPWMPatterns;
+    dev->numPWMPatterns = aPatterns;
+    if (aComplete) {
+      // lead when encoding is done
+      lead = dev->encodedNs-dev->sentNs;
+      if (lead<dev->pipelineMinLead) dev->pipelineMinLead = lead;
+      dev->pipelined = 0;
+      dev->pipelined_frames++;
+      dev->last_lead_ns = dev->pipelineMinLead;
+      if (dev->last_lead_ns<dev->min_lead_ns) dev->min_lead_ns = dev->last_lead_ns;
+      if (dev->pipelineStalled) {
+        dev->pipelineStalled = 0;
+        if (dev->remainingPWMPatterns==0) {
+          // sender had already sent the last pattern when it missed the next one
+          sendingComplete(ktime_to_ns(ktime_get()), dev);
+        }
+        else {
+          // chain has latched an incomplete frame, resend it when reset time is over
+          hrtimer_start(&dev->starttimer, ktime_set(0, (dev->sendBuf->chipDesc->TReset_nS)/2*3), HRTIMER_MODE_REL);
+        }
       }
     }
-    // shift input bit mask to next bit
-    inMask = inMask>>1;
-    // bit done
-    aNumBits--;
-  }
-}
-
-
-// finish bit generation, fill up last 64-bit PWM word
-static u32 finishBitGenerator(devPtr_t dev)
-{
-  u32 *owPtr;
-  // fill up to next 64bit
-  if (dev->bitCount!=0) {
-    // fill up current 32bit word
-    owPtr = &(dev->outPtr->data[(dev->bitCount & 0x20) ? 1 : 0]); // second word for bits 32..63
-    if (dev->outMask!=0) {
-      while (dev->outMask!=0) {
-        if (dev->inverted)
-          *owPtr |= (dev->outMask);
-        else
-          *owPtr &= ~(dev->outMask);
-        (dev->bitCount)++;
-        dev->nanosecs += dev->ledChipDesc->TPassive_min_nS;
-        dev->outMask = dev->outMask << 1;
-      }
+    dev->encodedNs = aEncodedNs;
+  }
+  spin_unlock_irqrestore(&dev->updatelock, irqflags);
+}
+
+
+// generate patterns for a frame of LED data into the back buffer, and start sending them as soon as the encoder
+// is far enough ahead of the sender to stay ahead until the end of the frame
+// Note: sending only starts with at most LEDCHAIN_PIPELINE_MAX_CHUNKS chunks left to encode, which bounds
+//   the time spent with preemption disabled
+// - aFirstLed: first LED to generate, patterns of the LEDs before are valid in aBuf already
+// - returns number of patterns in aBuf to be scheduled for sending, 0 if sending has started already
+static u32 generatePatternsPipelined(const u8 *aFrame, int aFirstLed, int aLeds, PatternBuffer_t *aBuf, devPtr_t dev)
+{
+  LedEncoder_t *enc = &dev->encoder;
+  int led;
+  int endLed;
+  u32 encoded = 0;
+  u64 encodedNs = 0;
+  int started = 0;
+  u32 numPatterns;
+
+  setupEncoder(dev);
+  led = beginEncoding(aFirstLed, aLeds, aBuf, enc);
+  while (led<aLeds) {
+    endLed = led+LEDCHAIN_PIPELINE_CHUNK;
+    if (endLed>aLeds) endLed = aLeds;
+    encodeLeds(aFrame, led, endLed, enc);
+    led = endLed;
+    // sum up sending time of patterns completed so far (including re-used ones)
+    while (encoded<completedPatterns(enc)) encodedNs += aBuf->patterns[encoded++].nanosecs;
+    if (started) {
+      extendPipelined(encoded, encodedNs, 0, dev);
     }
-    // test if still not 64 bits
-    if ((dev->bitCount & 0x3F)!=0) {
-      // need a dummy word to fill up
-      dev->outPtr->data[1] = dev->inverted ? 0xFFFFFFFF : 0x0;
-      dev->bitCount += 32;
-      dev->nanosecs += 32*dev->ledChipDesc->TPassive_min_nS;
+    else if (
+      encoded>0 &&
+      aLeds-led<=LEDCHAIN_PIPELINE_MAX_CHUNKS*LEDCHAIN_PIPELINE_CHUNK &&
+      encodedNs>=(u64)(aLeds-led)*dev->encodeNsPerLed*2+LEDCHAIN_PIPELINE_MARGIN_NS
+    ) {
+      // few enough LEDs left, and sending the encoded patterns takes longer than encoding these (with a wide margin):
+      // start sending, and do not get preempted until encoding is complete, so only IRQs can delay the encoder
+      preempt_disable();
+      started = startPipelined(encoded, encodedNs, dev);
+      if (!started) preempt_enable(); // chain busy, try again after next chunk
     }
-    // word full now, save nanosecs and advance
-    dev->outPtr->nanosecs = dev->nanosecs;
-    (dev->outPtr)++;
   }
-  // return number of new patterns
-  return dev->outPtr - dev->outBuf;
+  numPatterns = finishEncoding(enc);
+  if (numPatterns>dev->maxOutPatterns) dev->maxOutPatterns = numPatterns;
+  if (!started) return numPatterns;
+  while (encoded<numPatterns) encodedNs += aBuf->patterns[encoded++].nanosecs;
+  extendPipelined(numPatterns, encodedNs, 1, dev);
+  preempt_enable();
+  return 0; // already sending
 }
 
 
@@ -802,30 +1300,315 @@ static u32 finishBitGenerator(devPtr_t dev)
 #define STAT_INFO 0 // statistic info dump for every update
 
 
-void update_leds(const char *buff, size_t len, devPtr_t dev)
+// update encode time statistics for a frame whose pattern generation started at aStartedAt
+// - aLeds: number of LEDs encoded
+static void recordEncodeTime(long long aStartedAt, int aLeds, devPtr_t dev)
+{
+  long long t;
+  unsigned long irqflags;
+  u32 perLed;
+
+  t = ktime_to_ns(ktime_get())-aStartedAt;
+  if (t>0xFFFFFFFF) t = 0xFFFFFFFF;
+  if (aLeds>=LEDCHAIN_PIPELINE_CHUNK) {
+    // estimate for pipelining (not from small partial updates, dominated by fixed costs):
+    // follow slower encoding immediately, faster only slowly
+    perLed = (u32)t/aLeds;
+    dev->encodeNsPerLed -= dev->encodeNsPerLed>>3;
+    if (perLed>dev->encodeNsPerLed) dev->encodeNsPerLed = perLed;
+  }
+  spin_lock_irqsave(&dev->updatelock, irqflags);
+  dev->last_encode_ns = t;
+  if (dev->last_encode_ns>dev->max_encode_ns) dev->max_encode_ns = dev->last_encode_ns;
+  histogramAdd(&dev->hist_encode, dev->last_encode_ns);
+  spin_unlock_irqrestore(&dev->updatelock, irqflags);
+}
+
+
+// generate patterns for a new frame of LED data into the back buffer
+// - aFrame: LED data, ncomp bytes per LED in input order
+// - aLeds: number of LEDs in aFrame
+// - aDirtyFirst, aDirtyEnd: range of LEDs that have changed since the previous frame,
+//   aDirtyFirst<0 if unknown (aFrame will be compared with the previous frame)
+// - aSendNow: if set, sending may start while the rest of the frame is still being encoded
+// - returns number of patterns in the back buffer to be scheduled for sending, 0 if none (or already sending)
+static u32 prepare_frame(const u8 *aFrame, int aLeds, int aDirtyFirst, int aDirtyEnd, int aSendNow, devPtr_t dev)
 {
-  LedChip_t chipType;
-  LedLayout_t layoutType;
-  u32 ledword;
-  int leds;
   int ncomp;
   int i;
-  int hdrlen;
-  u8 *inPtr;
+  int firstLed;
   u32 newPatterns;
+  PatternBuffer_t *pb;
+  u32 pendingPatterns;
+  int changed;
+  long long startedAt;
   #if DATA_DUMP
   int k;
   int idx;
   #endif
 
-  // make sure current sending is aborted
-  if (stopSendingPatterns(dev)) {
-    // was not ready yet
-    dev->overruns++;
+  startedAt = ktime_to_ns(ktime_get());
+  if (dev->maxTPassiveNs==0) dev->maxTPassiveNs = dev->ledChipDesc->TPassive_max_nS; // 0 = use chip's  default
+  ncomp = dev->ledLayoutDesc->channels;
+  #if DATA_DUMP
+  // show LED input data
+  for (idx=0, k=0; k<aLeds; k++) {
+    if (ncomp==4) {
+      printk(KERN_INFO LOGPREFIX "RGBW LED#%03d : R=%3d, G=%3d, B=%3d, W=%3d\n", k, aFrame[idx], aFrame[idx+1], aFrame[idx+2], aFrame[idx+3]);
+    }
+    else {
+      printk(KERN_INFO LOGPREFIX "RGB LED#%03d : R=%3d, G=%3d, B=%3d\n", k, aFrame[idx], aFrame[idx+1], aFrame[idx+2]);
+    }
+    idx += ncomp;
+  }
+  #endif
+  // make sure back buffer does not get sent while we generate new patterns into it
+  pendingPatterns = takePendingPatterns(dev);
+  // determine range of LEDs changed since the most recent frame
+  if (aLeds!=dev->frameLeds || dev->ledChipDesc!=dev->frameChipDesc || dev->ledLayoutDesc!=dev->frameLayoutDesc) {
+    // different number or type of LEDs, nothing can be re-used
+    changed = 1;
+    aDirtyFirst = 0;
+    aDirtyEnd = aLeds;
+    for (i=0; i<dev->numPatternBufs; i++) dev->patternBufs[i].validLeds = 0;
+    dev->frameLeds = aLeds;
+    dev->frameChipDesc = dev->ledChipDesc;
+    dev->frameLayoutDesc = dev->ledLayoutDesc;
+  }
+  else if (aDirtyFirst<0) {
+    // unknown, compare with most recent frame
+    for (i=0; i<aLeds*ncomp && aFrame[i]==dev->frame[i]; i++);
+    aDirtyFirst = i/ncomp;
+    aDirtyEnd = aLeds;
+    changed = aDirtyFirst<aDirtyEnd;
+  }
+  else {
+    // caller specified what has changed
+    changed = aDirtyFirst<aDirtyEnd;
+  }
+  if (!changed && (pendingPatterns || !dev->sendFailed) && !dev->frameObscured) {
+    // identical to most recent frame (which is pending, or being sent or was sent successfully) -> nothing to do
+    dev->skipped++;
     #if STAT_INFO
-    printk(KERN_INFO LOGPREFIX "#%d: was still busy sending data -> aborted and start again with new data\n", dev->pwm_channel);
+    printk(KERN_INFO LOGPREFIX "#%d: data identical to previous update -> skipped\n", dev->pwm_channel);
     #endif
+    return pendingPatterns; // still pending if it was
+  }
+  if (pendingPatterns) {
+    // pending update is replaced by this one before it could be sent
+    dev->superseded++;
+    #if STAT_INFO
+    printk(KERN_INFO LOGPREFIX "#%d: previous update still pending -> replaced by new data\n", dev->pwm_channel);
+    #endif
+  }
+  // remember most recent frame (unless compact input was expanded into it directly)
+  if (aDirtyFirst<aDirtyEnd && aFrame!=dev->frame) {
+    memcpy(dev->frame+aDirtyFirst*ncomp, aFrame+aDirtyFirst*ncomp, (aDirtyEnd-aDirtyFirst)*ncomp);
+  }
+  // patterns in all buffers are no longer valid from first changed LED onwards
+  for (i=0; i<dev->numPatternBufs; i++) {
+    if (dev->patternBufs[i].validLeds>aDirtyFirst) dev->patternBufs[i].validLeds = aDirtyFirst;
+  }
+  dev->frameObscured = 0;
+  // generate data into back buffer
+  // Note: when sending starts while encoding, the back buffer becomes the front buffer meanwhile
+  pb = dev->genBuf;
+  pb->submittedAt = dev->submittedAt;
+  firstLed = pb->validLeds<aLeds ? pb->validLeds : 0;
+  if (aSendNow && pipeline && aLeds>dev->maxPollLeds && dev->encodeNsPerLed>0) {
+    newPatterns = generatePatternsPipelined(aFrame, firstLed, aLeds, pb, dev);
+  }
+  else {
+    newPatterns = generatePatterns(aFrame, firstLed, aLeds, pb, dev);
+  }
+  // buffer now contains valid patterns for the entire frame
+  pb->validLeds = aLeds;
+  recordEncodeTime(startedAt, aLeds-firstLed, dev);
+  #if STAT_INFO
+  printk(KERN_INFO LOGPREFIX "number of 64-bit patterns to send=%u\n", newPatterns);
+  #endif
+  #if DATA_DUMP
+  for (k=0; k<newPatterns; k++) {
+    printk(
+      KERN_INFO LOGPREFIX "pattern #%d : 0x%08X 0x%08X - %u nS\n",
+      k, pb->patterns[k].data[0], pb->patterns[k].data[1], pb->patterns[k].nanosecs
+    );
+  }
+  #endif
+  // information
+  #if STAT_INFO
+  printk(
+    KERN_INFO LOGPREFIX "#%d: Previous update had %d retries, last timeout=%unS, min..max irq=%u..%unS, duration=%u..%uuS\n",
+    dev->pwm_channel, dev->sendRetries, dev->last_timeout_ns, dev->min_irq_delay, dev->max_irq_delay, dev->last_update_us
+  );
+  printk(
+    KERN_INFO LOGPREFIX "#%d: Totals: updates=%u, overruns=%u, superseded=%u, retries=%u, errors=%u, irqs=%u\n",
+    dev->pwm_channel, dev->updates, dev->overruns, dev->superseded, dev->retries, dev->errors, dev->irq_count
+  );
+  #else
+  if (dev->sendRetries>dev->maxSendRetries) {
+    printk(
+      KERN_INFO LOGPREFIX "#%d: Previous update failed (%d repeats) - Totals: updates=%u, retries=%u, errors=%u, irqs=%u\n",
+      dev->pwm_channel, dev->sendRetries, dev->updates, dev->retries, dev->errors, dev->irq_count
+    );
+  }
+  #endif
+  return newPatterns;
+}
+
+
+// generate patterns for a new frame of LED data and send them
+static void update_frame(const u8 *aFrame, int aLeds, int aDirtyFirst, int aDirtyEnd, devPtr_t dev)
+{
+  u32 newPatterns;
+
+  newPatterns = prepare_frame(aFrame, aLeds, aDirtyFirst, aDirtyEnd, 1, dev);
+  if (newPatterns>0) {
+    // start sending now or schedule start when reset time is over
+    scheduleNewPatterns(newPatterns, dev);
+  }
+}
+
+
+// store color of one LED into the most recent frame
+// - aXor: if set, aColor is XORed with the previous color
+// - extends dirty range aDirtyFirst..aDirtyEnd when the color changes
+static void storeLed(int aLed, const u8 *aColor, int aXor, int *aDirtyFirst, int *aDirtyEnd, devPtr_t dev)
+{
+  int ncomp = dev->ledLayoutDesc->channels;
+  u8 *p = dev->frame + aLed*ncomp;
+  int changed = 0;
+  u8 b;
+  int i;
+
+  for (i=0; i<ncomp; i++) {
+    b = aXor ? p[i]^aColor[i] : aColor[i];
+    if (b!=p[i]) {
+      p[i] = b;
+      changed = 1;
+    }
+  }
+  if (changed) {
+    if (aLed<*aDirtyFirst) *aDirtyFirst = aLed;
+    if (aLed>=*aDirtyEnd) *aDirtyEnd = aLed+1;
+  }
+}
+
+
+// expand compact input data directly into the most recent frame
+// - returns number of LEDs in the new frame, negative on error
+static int expand_frame(int aFormat, const u8 *aData, size_t aLen, int *aDirtyFirst, int *aDirtyEnd, devPtr_t dev)
+{
+  int ncomp = dev->ledLayoutDesc->channels;
+  const u8 *end = aData+aLen;
+  const u8 *color;
+  int led = 0;
+  int count;
+  int index;
+
+  *aDirtyFirst = dev->num_leds;
+  *aDirtyEnd = 0;
+  if (aFormat==P44LEDCHAIN_FORMAT_XOR_RUNS || aFormat==P44LEDCHAIN_FORMAT_SPARSE) {
+    // modifies previous frame
+    if (dev->frameLayoutDesc!=dev->ledLayoutDesc) {
+      printk(KERN_WARNING LOGPREFIX "#%d: XOR delta and sparse data need previous frame with same LED layout\n", dev->pwm_channel);
+      return -EINVAL;
+    }
+    // - LEDs not in previous frame are black
+    if (dev->frameLeds<dev->num_leds) memset(dev->frame+dev->frameLeds*ncomp, 0, (dev->num_leds-dev->frameLeds)*ncomp);
+  }
+  switch (aFormat) {
+    case P44LEDCHAIN_FORMAT_PALETTE:
+      // one palette index per LED
+      while (aData<end && led<dev->num_leds) {
+        storeLed(led++, dev->palette.colors[*aData++], 0, aDirtyFirst, aDirtyEnd, dev);
+      }
+      break;
+    case P44LEDCHAIN_FORMAT_SPARSE:
+      // list of LED index and color, other LEDs remain unchanged
+      led = dev->frameLeds;
+      while (aData+2+ncomp<=end) {
+        index = (aData[0]<<8) + aData[1];
+        if (index<dev->num_leds) {
+          storeLed(index, aData+2, 0, aDirtyFirst, aDirtyEnd, dev);
+          if (index>=led) led = index+1;
+        }
+        aData += 2+ncomp;
+      }
+      break;
+    case P44LEDCHAIN_FORMAT_XOR_RUNS: // delta to previous frame
+    case P44LEDCHAIN_FORMAT_RUNS:
+      // runs of count byte followed by color
+      while (aData+1+ncomp<=end) {
+        count = *aData;
+        color = aData+1;
+        aData += 1+ncomp;
+        if (count==0) {
+          printk(KERN_WARNING LOGPREFIX "#%d: invalid run length 0\n", dev->pwm_channel);
+          return -EINVAL;
+        }
+        while (count-->0 && led<dev->num_leds) {
+          storeLed(led++, color, aFormat==P44LEDCHAIN_FORMAT_XOR_RUNS, aDirtyFirst, aDirtyEnd, dev);
+        }
+      }
+      break;
+    default:
+      printk(KERN_WARNING LOGPREFIX "#%d: unknown data format %d\n", dev->pwm_channel, aFormat);
+      return -EINVAL;
+  }
+  return led;
+}
+
+
+// update part of the most recent frame with raw LED data (no header) at a byte offset and send it
+// - returns 0 or negative error
+static int update_partial(const u8 *aData, size_t aLen, loff_t aOffset, devPtr_t dev)
+{
+  int ncomp;
+  int frameBytes;
+  int leds;
+  int first;
+  int last;
+
+  if (!dev->ledLayoutDesc) {
+    // variable mode, but no LED type set by a write with header so far
+    return -EINVAL;
+  }
+  ncomp = dev->ledLayoutDesc->channels;
+  frameBytes = dev->num_leds*ncomp;
+  if (aOffset>=frameBytes) return 0; // beyond end of chain, ignore
+  if (aLen>frameBytes-aOffset) aLen = frameBytes-aOffset;
+  // frame extends to at least the last LED touched
+  leds = (aOffset+aLen+ncomp-1)/ncomp;
+  if (leds<dev->frameLeds) leds = dev->frameLeds;
+  // - LEDs not in previous frame are black, not left over from an earlier, longer frame
+  if (dev->frameLeds<leds) memset(dev->frame+dev->frameLeds*ncomp, 0, (leds-dev->frameLeds)*ncomp);
+  // find range that actually changes
+  for (first=0; first<aLen && aData[first]==dev->frame[aOffset+first]; first++);
+  for (last=aLen; last>first && aData[last-1]==dev->frame[aOffset+last-1]; last--);
+  if (first<last) {
+    memcpy(dev->frame+aOffset+first, aData+first, last-first);
+    update_frame(dev->frame, leds, (aOffset+first)/ncomp, (aOffset+last+ncomp-1)/ncomp, dev);
   }
+  else {
+    // no change in LED data (but number of LEDs might have changed, or previous frame might need resending)
+    update_frame(dev->frame, leds, 0, 0, dev);
+  }
+  return 0;
+}
+
+
+void update_leds(const char *buff, size_t len, devPtr_t dev)
+{
+  LedChip_t chipType;
+  LedLayout_t layoutType;
+  int leds;
+  int ncomp;
+  int hdrlen;
+  int format = P44LEDCHAIN_FORMAT_RAW;
+  int dirtyFirst;
+  int dirtyEnd;
+
   // check for variable LED type mode
   if (dev->layoutType==ledlayout_none) {
     // first byte is the header length
@@ -853,6 +1636,10 @@ void update_leds(const char *buff, size_t len, devPtr_t dev)
       if (buff[5]!=0) {
         dev->maxSendRetries = buff[5];
       }
+      // v7 header can have data format
+      if (hdrlen>=6) {
+        format = buff[6];
+      }
       // header processed
       #if DATA_DUMP
       printk(
@@ -864,7 +1651,12 @@ void update_leds(const char *buff, size_t len, devPtr_t dev)
       len -= hdrlen+1;
     }
   }
-  if (dev->maxTPassiveNs==0) dev->maxTPassiveNs = dev->ledChipDesc->TPassive_max_nS; // 0 = use chip's  default
+  if (format!=P44LEDCHAIN_FORMAT_RAW) {
+    // compact data, expand into most recent frame and send that
+    leds = expand_frame(format, (const u8 *)buff, len, &dirtyFirst, &dirtyEnd, dev);
+    if (leds>=0) update_frame(dev->frame, leds, dirtyFirst, dirtyEnd, dev);
+    return;
+  }
   // calculate number of LEDs
   ncomp = dev->ledLayoutDesc->channels;
   leds = len/ncomp;
@@ -873,75 +1665,448 @@ void update_leds(const char *buff, size_t len, devPtr_t dev)
   #if STAT_INFO
   printk(KERN_INFO LOGPREFIX "#%d: Received %d bytes -> data for %d LEDs with %d bytes each\n", dev->pwm_channel, len, leds, ncomp);
   #endif
-  inPtr = (u8 *)buff;
-  #if DATA_DUMP
-  // show LED input data
-  for (idx=0, k=0; k<leds; k++) {
-    if (ncomp==4) {
-      printk(KERN_INFO LOGPREFIX "RGBW LED#%03d : R=%3d, G=%3d, B=%3d, W=%3d\n", k, inPtr[idx], inPtr[idx+1], inPtr[idx+2], inPtr[idx+3]);
+  // generate and send
+  update_frame((const u8 *)buff, leds, -1, 0, dev);
+}
+
+
+// MARK: ===== timing calibration
+
+#define CALIBRATION_DEFAULT_FRAMES 50
+#define CALIBRATION_DEFAULT_RETRIES 10
+#define CALIBRATION_MAX_TOTAL_FRAMES 1000 // max frames of all steps together (writers are blocked during calibration)
+
+// send the most recent frame again and wait until it is completely sent
+// - returns 0 or negative error
+static int calibration_frame(struct p44ledchain_calibration_step *aStep, u64 *aUpdateUsSum, devPtr_t dev)
+{
+  u32 newPatterns;
+  unsigned long irqflags;
+  int err;
+
+  takePendingPatterns(dev);
+  newPatterns = generatePatterns(dev->frame, 0, dev->frameLeds, dev->genBuf, dev);
+  dev->genBuf->validLeds = dev->frameLeds;
+  dev->genBuf->submittedAt = ktime_to_ns(ktime_get());
+  scheduleNewPatterns(newPatterns, dev);
+  err = wait_event_interruptible(dev->readywait, isIdle(dev));
+  if (err) return -EINTR; // do not restart, but abort the calibration
+  spin_lock_irqsave(&dev->updatelock, irqflags);
+  aStep->frames++;
+  if (dev->sendFailed) {
+    aStep->errors++;
+  }
+  else {
+    aStep->retries += dev->sendRetries;
+    if (dev->sendRetries>aStep->max_retries) aStep->max_retries = dev->sendRetries;
+    *aUpdateUsSum += dev->last_update_us;
+  }
+  if (dev->max_irq_delay>aStep->max_irq_delay_ns) aStep->max_irq_delay_ns = dev->max_irq_delay;
+  spin_unlock_irqrestore(&dev->updatelock, irqflags);
+  return 0;
+}
+
+
+// set timing parameters
+static void setTiming(int aMaxTPassiveNs, int aMaxSendRetries, devPtr_t dev)
+{
+  unsigned long irqflags;
+
+  spin_lock_irqsave(&dev->updatelock, irqflags);
+  dev->maxTPassiveNs = aMaxTPassiveNs;
+  dev->maxSendRetries = aMaxSendRetries;
+  spin_unlock_irqrestore(&dev->updatelock, irqflags);
+}
+
+
+// sweep maxTPassiveNs from max down to min, sending the most recent frame repeatedly for each step,
+// and determine the lowest maxTPassiveNs that still reliably completes frames without getting slower
+// because of too many retries, and the number of retries needed for it
+static int calibrate(struct p44ledchain_calibration *aCalib, devPtr_t dev)
+{
+  struct p44ledchain_calibration_step *step;
+  u64 updateUsSum;
+  int origTPassive;
+  int origRetries;
+  int tpassive;
+  int stepNs;
+  int numSteps;
+  u32 bestUs;
+  int i;
+  int err = 0;
+
+  if (dev->frameLeds==0) {
+    // need a frame of real LED data to send
+    return -ENODATA;
+  }
+  // defaults
+  if (aCalib->max_tpassive_ns==0) aCalib->max_tpassive_ns = dev->ledChipDesc->TPassive_max_nS;
+  if (aCalib->min_tpassive_ns==0) aCalib->min_tpassive_ns = MIN_MAXTPASSIVE_NS;
+  if (aCalib->min_tpassive_ns>aCalib->max_tpassive_ns) return -EINVAL;
+  if (aCalib->retry_budget==0) aCalib->retry_budget = CALIBRATION_DEFAULT_RETRIES;
+  stepNs = aCalib->step_ns;
+  if (stepNs==0) stepNs = (aCalib->max_tpassive_ns-aCalib->min_tpassive_ns)/(P44LEDCHAIN_CALIBRATION_STEPS-1);
+  if (stepNs==0) stepNs = 1;
+  // - limit frames per step so the entire sweep does not block writers for too long
+  numSteps = (aCalib->max_tpassive_ns-aCalib->min_tpassive_ns)/stepNs+1;
+  if (numSteps>P44LEDCHAIN_CALIBRATION_STEPS) numSteps = P44LEDCHAIN_CALIBRATION_STEPS;
+  if (aCalib->frames==0) aCalib->frames = CALIBRATION_DEFAULT_FRAMES;
+  if (aCalib->frames>CALIBRATION_MAX_TOTAL_FRAMES/numSteps) aCalib->frames = CALIBRATION_MAX_TOTAL_FRAMES/numSteps;
+  origTPassive = dev->maxTPassiveNs;
+  origRetries = dev->maxSendRetries;
+  // sweep
+  aCalib->num_steps = 0;
+  tpassive = aCalib->max_tpassive_ns;
+  while (tpassive>=(int)aCalib->min_tpassive_ns && aCalib->num_steps<P44LEDCHAIN_CALIBRATION_STEPS) {
+    step = &aCalib->steps[aCalib->num_steps++];
+    memset(step, 0, sizeof(*step));
+    step->max_tpassive_ns = tpassive;
+    setTiming(tpassive, aCalib->retry_budget, dev);
+    updateUsSum = 0;
+    for (i=0; i<aCalib->frames; i++) {
+      if (signal_pending(current)) {
+        err = -EINTR;
+        break;
+      }
+      err = calibration_frame(step, &updateUsSum, dev);
+      if (err) break;
     }
-    else {
-      printk(KERN_INFO LOGPREFIX "RGB LED#%03d : R=%3d, G=%3d, B=%3d\n", k, inPtr[idx], inPtr[idx+1], inPtr[idx+2]);
+    if (err) {
+      // interrupted: no result, previous settings remain
+      setTiming(origTPassive, origRetries, dev);
+      return err;
     }
-    idx += ncomp;
+    if (step->frames>step->errors) step->avg_update_us = div_u64(updateUsSum, step->frames-step->errors);
+    if (step->errors>0) break; // lower values will not work any better
+    tpassive -= stepNs;
   }
-  #endif
-  // generate data into buffer
-  initBitGenerator(dev);
-  // generate bits into buffer
-  while (leds>0) {
-    i = 0;
-    ledword = 0;
-    while (true) {
-      ledword |= inPtr[dev->ledLayoutDesc->fetchIdx[i]];
-      i++;
-      if (i>=ncomp)
-        break;
-      ledword <<= 8;
+  // choose lowest maxTPassiveNs that had no errors and is not notably slower (max 10%) than the fastest
+  bestUs = 0xFFFFFFFF;
+  for (i=0; i<aCalib->num_steps; i++) {
+    step = &aCalib->steps[i];
+    if (step->errors==0 && step->frames>0 && step->avg_update_us<bestUs) bestUs = step->avg_update_us;
+  }
+  aCalib->tpassive_ns = 0;
+  aCalib->retries = 0;
+  for (i=0; i<aCalib->num_steps; i++) {
+    step = &aCalib->steps[i];
+    if (step->errors==0 && step->frames>0 && step->avg_update_us<=bestUs+bestUs/10) {
+      aCalib->tpassive_ns = step->max_tpassive_ns;
+      // allow one more failed try than ever seen before giving up, but not less than default
+      aCalib->retries = step->max_retries+1;
+      if (aCalib->retries<DEFAULT_MAX_RETRIES) aCalib->retries = DEFAULT_MAX_RETRIES;
     }
-    generateBits(ledword, ncomp*8, dev);
-    inPtr += ncomp;
-    // next LED
-    leds--;
   }
-  // finish bit generation
-  newPatterns = finishBitGenerator(dev);
-  #if STAT_INFO
-  printk(KERN_INFO LOGPREFIX "number of 64-bit patterns to send=%u\n", newPatterns);
-  #endif
-  #if DATA_DUMP
-  for (k=0; k<newPatterns; k++) {
-    printk(
-      KERN_INFO LOGPREFIX "pattern #%d : 0x%08X 0x%08X - %u nS\n",
-      k, dev->outBuf[k].data[0], dev->outBuf[k].data[1], dev->outBuf[k].nanosecs
-    );
+  if (aCalib->tpassive_ns && (aCalib->flags & P44LEDCHAIN_CALIBRATE_APPLY)) {
+    setTiming(aCalib->tpassive_ns, aCalib->retries, dev);
   }
-  #endif
-  // information
-  SEQ_TRACE_SHOW()
-  #if STAT_INFO
-  printk(
-    KERN_INFO LOGPREFIX "#%d: Previous update had %d retries, last timeout=%unS, min..max irq=%u..%unS, duration=%u..%uuS\n",
-    dev->pwm_channel, dev->sendRetries, dev->last_timeout_ns, dev->min_irq_delay, dev->max_irq_delay, dev->last_update_us
-  );
-  printk(
-    KERN_INFO LOGPREFIX "#%d: Totals: updates=%u, overruns=%u, retries=%u, errors=%u, irqs=%u\n",
-    dev->updates, dev->overruns, dev->retries, dev->errors, dev->irq_count
-  );
-  #else
-  if (dev->sendRetries>dev->maxSendRetries) {
-    printk(
-      KERN_INFO LOGPREFIX "#%d: Previous update failed (%d repeats) - Totals: updates=%u, retries=%u, errors=%u, irqs=%u\n",
-      dev->pwm_channel, dev->sendRetries, dev->updates, dev->retries, dev->errors, dev->irq_count
-    );
+  else {
+    setTiming(origTPassive, origRetries, dev);
   }
-  #endif
-  // start sending now or schedule start when reset time is over
-  SEQ_TRACE_CLEAR()
-  scheduleNewPatterns(newPatterns, dev);
+  // remember result
+  dev->calibTPassiveNs = aCalib->tpassive_ns;
+  dev->calibRetries = aCalib->retries;
+  return 0;
+}
+
+
+// MARK: ===== color correction
+
+// calculate lookup tables from correction values
+static void calcCorrectionLut(devPtr_t dev)
+{
+  const struct p44ledchain_correction *corr = &dev->correction;
+  int c;
+  int v;
+
+  for (c=0; c<4; c++) {
+    for (v=0; v<256; v++) {
+      // gamma[v]*white_balance[c]/255*brightness/255, rounded
+      dev->lut[c][v] = ((u32)corr->gamma[v]*corr->white_balance[c]*corr->brightness + 255*255/2) / (255*255);
+    }
+  }
+}
+
+
+// set default (neutral) correction
+static void initCorrection(devPtr_t dev)
+{
+  int i;
+
+  for (i=0; i<256; i++) dev->correction.gamma[i] = i;
+  for (i=0; i<4; i++) dev->correction.white_balance[i] = 255;
+  dev->correction.brightness = 255;
+  calcCorrectionLut(dev);
+}
+
+
+// set new correction and send the most recent frame again with it applied
+// - must be called with writelock held
+static void setCorrection(const struct p44ledchain_correction *aCorrection, devPtr_t dev)
+{
+  u32 newPatterns;
+  int i;
+
+  dev->correction = *aCorrection;
+  memset(dev->correction.reserved, 0, sizeof(dev->correction.reserved));
+  calcCorrectionLut(dev);
+  // all patterns generated so far are based on old correction
+  for (i=0; i<dev->numPatternBufs; i++) dev->patternBufs[i].validLeds = 0;
+  if (dev->frameLeds>0 && !dev->frameObscured) {
+    // re-send most recent frame (unless timed frames were queued after it)
+    takePendingPatterns(dev);
+    newPatterns = generatePatterns(dev->frame, 0, dev->frameLeds, dev->genBuf, dev);
+    dev->genBuf->validLeds = dev->frameLeds;
+    dev->genBuf->submittedAt = ktime_to_ns(ktime_get());
+    scheduleNewPatterns(newPatterns, dev);
+  }
+}
+
+
+// MARK: ===== runtime configuration
+
+// page order of a mmap() frame buffer of the given size
+// Note: allocated as whole pages of at least order 1, so the kernel address is aligned such that
+//   user space mappings (which are colour aligned to the file offset on MIPS) do not alias in the D-cache
+static int mapBufOrder(u32 aSize)
+{
+  int order = get_order(aSize);
+  return order<1 ? 1 : order;
 }
 
 
+// parse LED type (as in the ledchainN module parameter) into layout and chip type
+// - aDevName: for warnings, NULL for none
+static int parseLedType(u16 aLedType, LedLayout_t *aLayoutType, LedChip_t *aChipType, const char *aDevName)
+{
+  // - LED type can be either:
+  //   - MSB==0 -> LSB=one of the old predefined types
+  //   - MSB!=0 -> MSB=layout, LSB=chip
+  *aChipType = 0;
+  if ((aLedType&ledtype_layout_mask)!=0) {
+    // direct specification of layout and type
+    *aLayoutType = (aLedType&ledtype_layout_mask)>>8;
+    *aChipType = aLedType&ledtype_chip_mask;
+    if (*aLayoutType>=num_ledlayouts) {
+      if (aDevName) printk(KERN_WARNING LOGPREFIX "MSB of LED type is layout type and must be 1..%d for %s\n", num_ledlayouts-1, aDevName);
+      return -EINVAL;
+    }
+    else if (*aChipType==0 || *aChipType>=num_ledchips) {
+      if (aDevName) printk(KERN_WARNING LOGPREFIX "LSB of LED type is chip type and must be 1..%d for %s\n", num_ledchips-1, aDevName);
+      return -EINVAL;
+    }
+  }
+  else {
+    // indirect specification of layout and type via legacy led types
+    if (aLedType==ledtype_variable) {
+      *aLayoutType = ledlayout_none; // signals layout+chip are determined by data for every update
+    }
+    else {
+      if (aLedType>=num_predef_ledtypes) {
+        if (aDevName) printk(KERN_WARNING LOGPREFIX "LED type must be 0..%d or 255 for %s\n", num_predef_ledtypes-1, aDevName);
+        return -EINVAL;
+      }
+      *aLayoutType = predefLedTypeDescriptors[aLedType].layout;
+      *aChipType = predefLedTypeDescriptors[aLedType].chip;
+    }
+  }
+  return 0;
+}
+
+
+// free pattern buffers (entries can be NULL)
+static void freePatternBufs(PWMPattern_t **aPatterns, u32 **aLedBitPos, int aNumBufs)
+{
+  int i;
+
+  for (i=0; i<aNumBufs; i++) {
+    vfree(aLedBitPos[i]);
+    vfree(aPatterns[i]);
+  }
+}
+
+
+// (re)allocate PWM pattern, input, frame and mmap() buffers for aNumLeds LEDs with up to aChannels channels
+// - aChip: LED chip to size pattern buffers for, NULL for worst case of all chips (variable mode)
+// - the device's buffers are replaced only when all new buffers could be allocated
+// - must be called with writelock held and the chain idle (nothing being sent, pending or queued)
+// Note: all buffers except the mmap() frame buffer (which must be physically contiguous for remap_pfn_range())
+//   are vmalloc()ed, so long chains do not need large physically contiguous allocations
+static int allocBuffers(int aNumLeds, int aChannels, const LedChipDescriptor_t *aChip, devPtr_t dev)
+{
+  PWMPattern_t *patterns[2+LEDCHAIN_MAX_FRAMEQUEUE];
+  u32 *ledBitPos[2+LEDCHAIN_MAX_FRAMEQUEUE];
+  int numPatternBufs = 2+framequeue; // front and back buffer plus buffers for timed frames
+  u32 outBufPatterns;
+  u32 outBufSize;
+  u32 inBufSize;
+  char *inBuf;
+  u8 *frame;
+  u8 *mapBuf = NULL;
+  u32 mapBufSize;
+  int mapOrder;
+  unsigned long irqflags;
+  int i;
+
+  outBufPatterns = maxPatterns(aNumLeds, aChannels, aChip);
+  outBufSize = outBufPatterns*sizeof(PWMPattern_t);
+  inBufSize = LEDCHAIN_MAX_HEADER + aNumLeds*4; // always assume 4 channels in case of variable layout
+  mapBufSize = aNumLeds*aChannels;
+  mapOrder = mapBufOrder(mapBufSize);
+  // current mmap() frame buffer is kept when it is large enough
+  // (it cannot be replaced while mapped, user space would write into freed pages)
+  if (!dev->mapBuf || mapOrder>dev->mapBufOrder) {
+    if (atomic_read(&dev->mapCount)>0) return -EBUSY;
+  }
+  else {
+    mapOrder = dev->mapBufOrder;
+  }
+  memset(patterns, 0, sizeof(patterns));
+  memset(ledBitPos, 0, sizeof(ledBitPos));
+  for (i=0; i<numPatternBufs; i++) {
+    patterns[i] = vzalloc(outBufSize);
+    ledBitPos[i] = vmalloc(aNumLeds*sizeof(u32));
+    if (!patterns[i] || !ledBitPos[i]) break;
+  }
+  inBuf = vmalloc(inBufSize);
+  frame = vzalloc(aNumLeds*4); // LEDs not yet set by any update are black
+  if (mapOrder!=dev->mapBufOrder) mapBuf = (u8 *)__get_free_pages(GFP_KERNEL|__GFP_ZERO, mapOrder);
+  if (i<numPatternBufs || !inBuf || !frame || (mapOrder!=dev->mapBufOrder && !mapBuf)) {
+    printk(KERN_WARNING LOGPREFIX "#%d: Cannot allocate buffers for %d LEDs (%d*%u bytes PWM data)\n", dev->pwm_channel, aNumLeds, numPatternBufs, outBufSize);
+    freePatternBufs(patterns, ledBitPos, numPatternBufs);
+    vfree(inBuf);
+    vfree(frame);
+    if (mapBuf) free_pages((unsigned long)mapBuf, mapOrder);
+    return -ENOMEM;
+  }
+  // swap in the new buffers
+  spin_lock_irqsave(&dev->updatelock, irqflags);
+  for (i=0; i<numPatternBufs; i++) {
+    swap(dev->patternBufs[i].patterns, patterns[i]);
+    swap(dev->patternBufs[i].ledBitPos, ledBitPos[i]);
+    dev->patternBufs[i].validLeds = 0;
+  }
+  dev->numPatternBufs = numPatternBufs;
+  dev->outBufSize = outBufSize;
+  dev->outBufPatterns = outBufPatterns;
+  dev->maxOutPatterns = 0;
+  swap(dev->inBuf, inBuf);
+  dev->inBufSize = inBufSize;
+  swap(dev->frame, frame);
+  dev->frameLeds = 0;
+  if (mapOrder!=dev->mapBufOrder) {
+    swap(dev->mapBuf, mapBuf);
+    swap(dev->mapBufOrder, mapOrder);
+  }
+  dev->mapBufSize = mapBufSize;
+  spin_unlock_irqrestore(&dev->updatelock, irqflags);
+  // free the old ones
+  freePatternBufs(patterns, ledBitPos, numPatternBufs);
+  vfree(inBuf);
+  vfree(frame);
+  if (mapBuf) free_pages((unsigned long)mapBuf, mapOrder);
+  return 0;
+}
+
+
+// free all buffers of the device
+static void freeBuffers(devPtr_t dev)
+{
+  int i;
+
+  if (dev->mapBuf) free_pages((unsigned long)dev->mapBuf, dev->mapBufOrder);
+  vfree(dev->frame);
+  vfree(dev->inBuf);
+  for (i=0; i<dev->numPatternBufs; i++) {
+    vfree(dev->patternBufs[i].ledBitPos);
+    vfree(dev->patternBufs[i].patterns);
+  }
+}
+
+
+// set LED type, layout and chip descriptors (if fixed)
+static void setLedType(u16 aLedType, LedLayout_t aLayoutType, LedChip_t aChipType, devPtr_t dev)
+{
+  dev->ledType = aLedType;
+  dev->layoutType = aLayoutType;
+  dev->chipType = aChipType;
+  if (dev->layoutType!=ledlayout_none) {
+    // led type and layout is fixed for the device, can set descriptor pointers now
+    dev->ledChipDesc = &ledChipDescriptors[dev->chipType-1];
+    dev->ledLayoutDesc = &ledLayoutDescriptors[dev->layoutType-1];
+  }
+  else {
+    // variable mode: no type until set by a write()
+    dev->ledChipDesc = NULL;
+    dev->ledLayoutDesc = NULL;
+  }
+}
+
+
+static void getConfig(struct p44ledchain_config *aConfig, devPtr_t dev)
+{
+  memset(aConfig, 0, sizeof(*aConfig));
+  aConfig->num_leds = dev->num_leds;
+  aConfig->led_type = dev->ledType;
+  aConfig->max_retries = dev->maxSendRetries;
+  aConfig->max_tpassive_ns = dev->maxTPassiveNs;
+  aConfig->max_poll_leds = dev->maxPollLeds;
+}
+
+
+// change configuration of a live device
+// - must be called with writelock held, waits until the chain is idle
+static int setConfig(struct file *filp, const struct p44ledchain_config *aConfig, devPtr_t dev)
+{
+  LedLayout_t layoutType;
+  LedChip_t chipType;
+  const LedChipDescriptor_t *chip;
+  int channels;
+  int err;
+  unsigned long irqflags;
+
+  if (aConfig->num_leds<1 || aConfig->num_leds>LEDCHAIN_MAX_LEDS) return -EINVAL;
+  if (aConfig->led_type>0xFFFF || aConfig->max_retries>INT_MAX) return -EINVAL;
+  if (aConfig->max_tpassive_ns>0 && (aConfig->max_tpassive_ns<MIN_MAXTPASSIVE_NS || aConfig->max_tpassive_ns>INT_MAX)) return -EINVAL;
+  if (aConfig->max_poll_leds>LEDCHAIN_MAX_POLL_LEDS) return -EINVAL;
+  err = parseLedType(aConfig->led_type, &layoutType, &chipType, NULL);
+  if (err) return err;
+  // buffers can only be replaced when nothing is being sent
+  err = waitForIdle(filp, dev);
+  if (err) return err;
+  channels = layoutType!=ledlayout_none ? ledLayoutDescriptors[layoutType-1].channels : 4; // always assume 4 in case of variable layout
+  chip = layoutType!=ledlayout_none ? &ledChipDescriptors[chipType-1] : NULL; // size for any chip in case of variable layout
+  if (
+    aConfig->num_leds!=dev->num_leds ||
+    channels*dev->num_leds!=dev->mapBufSize ||
+    maxPatterns(aConfig->num_leds, channels, chip)!=dev->outBufPatterns
+  ) {
+    err = allocBuffers(aConfig->num_leds, channels, chip, dev);
+    if (err) return err;
+  }
+  spin_lock_irqsave(&dev->updatelock, irqflags);
+  dev->num_leds = aConfig->num_leds;
+  setLedType(aConfig->led_type, layoutType, chipType, dev);
+  dev->maxSendRetries = aConfig->max_retries;
+  dev->maxTPassiveNs = aConfig->max_tpassive_ns;
+  dev->maxPollLeds = aConfig->max_poll_leds;
+  // calibration was for the previous configuration
+  dev->calibTPassiveNs = 0;
+  dev->calibRetries = 0;
+  spin_unlock_irqrestore(&dev->updatelock, irqflags);
+  // most recent frame does not match new configuration, send next frame entirely
+  dev->frameLeds = 0;
+  dev->frameChipDesc = NULL;
+  dev->frameLayoutDesc = NULL;
+  dev->frameObscured = 0;
+  dev->sendBuf->validLeds = 0;
+  dev->genBuf->validLeds = 0;
+  printk(KERN_INFO LOGPREFIX "#%d: reconfigured: %d LEDs, type %s %s\n", dev->pwm_channel, dev->num_leds, (dev->ledChipDesc ? dev->ledChipDesc->name : "<variable>"), (dev->ledLayoutDesc ? dev->ledLayoutDesc->name : ""));
+  return 0;
+}
+
+
+
 // MARK: ===== character device file operations
 
 // prototypes
@@ -949,6 +2114,11 @@ static int p44ledchain_open(struct inode *, struct file *);
 static int p44ledchain_release(struct inode *, struct file *);
 static ssize_t p44ledchain_read(struct file *, char *, size_t, loff_t *);
 static ssize_t p44ledchain_write(struct file *, const char *, size_t, loff_t *);
+static int p44ledchain_mmap(struct file *, struct vm_area_struct *);
+static long p44ledchain_ioctl(struct file *, unsigned int, unsigned long);
+static unsigned int p44ledchain_poll(struct file *, poll_table *);
+static int p44ledchain_fsync(struct file *, loff_t, loff_t, int);
+static loff_t p44ledchain_llseek(struct file *, loff_t, int);
 
 // file access handlers
 static struct file_operations p44ledchain_fops = {
@@ -956,6 +2126,11 @@ static struct file_operations p44ledchain_fops = {
   .release = p44ledchain_release,
   .read = p44ledchain_read,
   .write = p44ledchain_write,
+  .mmap = p44ledchain_mmap,
+  .unlocked_ioctl = p44ledchain_ioctl,
+  .poll = p44ledchain_poll,
+  .fsync = p44ledchain_fsync,
+  .llseek = p44ledchain_llseek,
 };
 
 
@@ -976,22 +2151,115 @@ static int p44ledchain_release(struct inode *inode, struct file *filp)
 }
 
 
+// get consistent snapshot of status and statistics
+static void getStats(struct p44ledchain_stats *aStats, devPtr_t dev)
+{
+  unsigned long irqflags;
+
+  spin_lock_irqsave(&dev->updatelock, irqflags);
+  aStats->ready = !dev->notReady;
+  aStats->last_retries = dev->sendRetries;
+  aStats->last_timeout_ns = dev->last_timeout_ns;
+  aStats->min_irq_delay_ns = dev->min_irq_delay;
+  aStats->max_irq_delay_ns = dev->max_irq_delay;
+  aStats->last_update_us = dev->last_update_us;
+  aStats->updates = dev->updates;
+  aStats->overruns = dev->overruns;
+  aStats->superseded = dev->superseded;
+  aStats->skipped = dev->skipped;
+  aStats->retries = dev->retries;
+  aStats->errors = dev->errors;
+  aStats->irq_count = dev->irq_count;
+  aStats->min_update_us = dev->min_update_us;
+  aStats->max_update_us = dev->max_update_us;
+  aStats->queued = dev->numQueued;
+  aStats->timed_frames = dev->timed_frames;
+  aStats->last_lateness_ns = dev->last_lateness_ns;
+  aStats->max_lateness_ns = dev->max_lateness_ns;
+  aStats->max_tpassive_ns = dev->maxTPassiveNs;
+  aStats->max_retries = dev->maxSendRetries;
+  aStats->calib_tpassive_ns = dev->calibTPassiveNs;
+  aStats->calib_retries = dev->calibRetries;
+  aStats->early_refill = dev->earlyRefill;
+  aStats->min_refill_slack_ns = dev->min_refill_slack==0xFFFFFFFF ? 0 : dev->min_refill_slack;
+  aStats->refill_fallbacks = dev->refill_fallbacks;
+  aStats->hw_repeat = dev->hwRepeat;
+  aStats->repeated = dev->repeated;
+  aStats->max_poll_leds = dev->maxPollLeds;
+  aStats->polled_frames = dev->polled_frames;
+  aStats->last_irqoff_us = dev->last_irqoff_us;
+  aStats->max_irqoff_us = dev->max_irqoff_us;
+  aStats->pattern_bufs = dev->numPatternBufs;
+  aStats->pattern_buf_size = dev->outBufSize;
+  aStats->pattern_buf_peak = dev->maxOutPatterns*sizeof(PWMPattern_t);
+  aStats->pipeline = pipeline;
+  aStats->pipelined_frames = dev->pipelined_frames;
+  aStats->pipeline_underruns = dev->pipeline_underruns;
+  aStats->last_lead_ns = dev->last_lead_ns;
+  aStats->min_lead_ns = dev->min_lead_ns==0xFFFFFFFF ? 0 : dev->min_lead_ns;
+  spin_unlock_irqrestore(&dev->updatelock, irqflags);
+}
+
+
+// reset statistics totals
+static void resetStats(devPtr_t dev)
+{
+  unsigned long irqflags;
+
+  spin_lock_irqsave(&dev->updatelock, irqflags);
+  dev->updates = 0;
+  dev->overruns = 0;
+  dev->superseded = 0;
+  dev->skipped = 0;
+  dev->retries = 0;
+  dev->errors = 0;
+  dev->irq_count = 0;
+  dev->repeated = 0;
+  dev->polled_frames = 0;
+  dev->max_irqoff_us = 0;
+  dev->maxOutPatterns = 0;
+  dev->max_update_us = 0;
+  dev->min_update_us = 10000000; // ten seconds
+  dev->timed_frames = 0;
+  dev->max_lateness_ns = 0;
+  dev->pipelined_frames = 0;
+  dev->pipeline_underruns = 0;
+  dev->min_lead_ns = 0xFFFFFFFF;
+  spin_unlock_irqrestore(&dev->updatelock, irqflags);
+}
+
+
 static ssize_t p44ledchain_read(struct file *filp, char *buf, size_t count, loff_t *f_pos)
 {
-  const int ansBufferSize = 512;
+  const int ansBufferSize = 1024;
   char ans[ansBufferSize];
   size_t bytes = 0;
   devPtr_t dev = (devPtr_t)filp->private_data;
   const char *ansP;
+  struct p44ledchain_stats stats;
 
   // return "Ready" or "Busy" on first line, some stats on following lines
+  getStats(&stats, dev);
   bytes = snprintf(ans, ansBufferSize,
     "%s\n"
     "Last update: %d retries, last timeout=%dnS, min..max irq=%u..%unS, duration=%uuS\n"
-    "Totals: updates=%u, overruns=%u, retries=%u, errors=%u, irqs=%u, min..max update duration=%u..%uuS\n",
-    isReady(dev) ? "Ready" : "Busy",
-    dev->sendRetries, dev->last_timeout_ns, dev->min_irq_delay, dev->max_irq_delay, dev->last_update_us,
-    dev->updates, dev->overruns, dev->retries, dev->errors, dev->irq_count, dev->min_update_us, dev->max_update_us
+    "Totals: updates=%u, overruns=%u, superseded=%u, skipped=%u, retries=%u, errors=%u, irqs=%u, min..max update duration=%u..%uuS\n"
+    "Timed frames: queued=%u, started=%u, last..max lateness=%u..%unS\n"
+    "Timing: max Tpassive=%unS, max retries=%u, calibrated: max Tpassive=%unS, max retries=%u\n"
+    "Refill: %s, min slack=%unS, fallbacks=%u, hw repetition: %s, repeated=%u\n"
+    "Polling: max LEDs=%u, frames=%u, last..max IRQs off=%u..%uuS\n"
+    "Buffers: %u*%u bytes, peak use=%u bytes\n"
+    "Pipelining: %s, frames=%u, underruns=%u, last..min lead=%u..%unS\n",
+    stats.ready ? "Ready" : "Busy",
+    stats.last_retries, stats.last_timeout_ns, stats.min_irq_delay_ns, stats.max_irq_delay_ns, stats.last_update_us,
+    stats.updates, stats.overruns, stats.superseded, stats.skipped, stats.retries, stats.errors, stats.irq_count, stats.min_update_us, stats.max_update_us,
+    stats.queued, stats.timed_frames, stats.last_lateness_ns, stats.max_lateness_ns,
+    stats.max_tpassive_ns, stats.max_retries, stats.calib_tpassive_ns, stats.calib_retries,
+    stats.early_refill ? "early (underflow IRQ)" : "after finish IRQ", stats.min_refill_slack_ns, stats.refill_fallbacks,
+    stats.hw_repeat ? "on" : "off", stats.repeated,
+    stats.max_poll_leds, stats.polled_frames, stats.last_irqoff_us, stats.max_irqoff_us,
+    stats.pattern_bufs, stats.pattern_buf_size, stats.pattern_buf_peak,
+    stats.pipeline ? "on" : "off", stats.pipelined_frames, stats.pipeline_underruns, stats.last_lead_ns, stats.min_lead_ns
   );
   if (bytes<=0 || dev->read_idx>=bytes) {
     // all data read already before -> create an EOF conditon for now
@@ -1018,12 +2286,455 @@ static ssize_t p44ledchain_read(struct file *filp, char *buf, size_t count, loff
 static ssize_t p44ledchain_write(struct file *filp, const char *buff, size_t len, loff_t * off)
 {
   devPtr_t dev = (devPtr_t)filp->private_data;
+  size_t n;
+  int err;
+  long long submittedAt = ktime_to_ns(ktime_get());
+
+  // wait until previous data has started sending
+  err = waitForNewPatterns(filp, dev);
+  if (err) return err;
+  // data exceeding header+LED data for num_leds is ignored anyway
+  n = len>dev->inBufSize ? dev->inBufSize : len;
+  mutex_lock(&dev->writelock);
+  if (copy_from_user(dev->inBuf, buff, n)) {
+    mutex_unlock(&dev->writelock);
+    return -EFAULT;
+  }
+  dev->submittedAt = submittedAt;
+  if (*off>0) {
+    // partial update at file position (position is not advanced, plain write() always starts a frame at LED 0)
+    err = update_partial((const u8 *)dev->inBuf, n, *off, dev);
+  }
+  else {
+    update_leds(dev->inBuf, n, dev);
+  }
+  mutex_unlock(&dev->writelock);
+  return err ? err : len;
+}
+
+
+static unsigned int p44ledchain_poll(struct file *filp, poll_table *wait)
+{
+  devPtr_t dev = (devPtr_t)filp->private_data;
+  unsigned int mask = 0;
+
+  poll_wait(filp, &dev->readywait, wait);
+  // writable when new data would not supersede data still pending
+  if (canTakeNewPatterns(dev)) mask |= POLLOUT | POLLWRNORM;
+  return mask;
+}
+
+
+static int p44ledchain_fsync(struct file *filp, loff_t start, loff_t end, int datasync)
+{
+  devPtr_t dev = (devPtr_t)filp->private_data;
+
+  // wait until all data is sent and chain has latched it
+  return wait_event_interruptible(dev->readywait, isIdle(dev));
+}
+
+
+static loff_t p44ledchain_llseek(struct file *filp, loff_t offset, int whence)
+{
+  devPtr_t dev = (devPtr_t)filp->private_data;
+
+  // position within LED data of a frame, for partial updates
+  return fixed_size_llseek(filp, offset, whence, dev->num_leds*(dev->ledLayoutDesc ? dev->ledLayoutDesc->channels : 4));
+}
+
+
+// count mappings, so the frame buffer is not replaced by a reconfiguration while in use
+static void p44ledchain_vma_open(struct vm_area_struct *vma)
+{
+  devPtr_t dev = (devPtr_t)vma->vm_private_data;
+  atomic_inc(&dev->mapCount);
+}
+
+
+static void p44ledchain_vma_close(struct vm_area_struct *vma)
+{
+  devPtr_t dev = (devPtr_t)vma->vm_private_data;
+  atomic_dec(&dev->mapCount);
+}
+
+
+static const struct vm_operations_struct p44ledchain_vm_ops = {
+  .open = p44ledchain_vma_open,
+  .close = p44ledchain_vma_close,
+};
+
+
+static int p44ledchain_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+  devPtr_t dev = (devPtr_t)filp->private_data;
+  unsigned long size = vma->vm_end-vma->vm_start;
+  int err;
+
+  // Note: writelock keeps a reconfiguration from replacing the buffer while being mapped
+  mutex_lock(&dev->writelock);
+  if (vma->vm_pgoff!=0 || size>PAGE_ALIGN(dev->mapBufSize)) {
+    err = -EINVAL;
+  }
+  else {
+    err = remap_pfn_range(vma, vma->vm_start, virt_to_phys(dev->mapBuf)>>PAGE_SHIFT, size, vma->vm_page_prot);
+  }
+  if (err==0) {
+    vma->vm_ops = &p44ledchain_vm_ops;
+    vma->vm_private_data = dev;
+    p44ledchain_vma_open(vma);
+  }
+  mutex_unlock(&dev->writelock);
+  return err;
+}
+
+
+// number of LEDs in the mmap() frame buffer to send
+static int frame_leds(struct p44ledchain_commit *aCommit, devPtr_t dev)
+{
+  int leds;
+
+  leds = dev->mapBufSize/dev->ledLayoutDesc->channels;
+  if (leds>dev->num_leds) leds = dev->num_leds;
+  if (aCommit && aCommit->leds>0 && aCommit->leds<leds) leds = aCommit->leds;
+  return leds;
+}
+
 
-  update_leds(buff, len, dev);
+// generate patterns for contents of the mmap() frame buffer into the back buffer
+// - aSendNow: if set, sending may start while the rest of the frame is still being encoded
+// - returns number of patterns to be scheduled for sending (0 if none or already sending), or negative error
+static int prepare_commit(struct p44ledchain_commit *aCommit, int aSendNow, devPtr_t dev)
+{
+  int leds;
+  int dirtyFirst = -1; // unknown
+  int dirtyEnd = 0;
+
+  if (!dev->ledLayoutDesc) {
+    // variable led type mode, but no type set by a write() so far
+    return -EINVAL;
+  }
+  leds = frame_leds(aCommit, dev);
+  if (aCommit) {
+    if (aCommit->dirty_count!=P44LEDCHAIN_DIRTY_UNKNOWN) {
+      // caller knows what has changed
+      dirtyFirst = aCommit->dirty_first>leds ? leds : aCommit->dirty_first;
+      dirtyEnd = aCommit->dirty_count>leds-dirtyFirst ? leds : dirtyFirst+aCommit->dirty_count;
+    }
+  }
+  return prepare_frame(dev->mapBuf, leds, dirtyFirst, dirtyEnd, aSendNow, dev);
+}
+
+
+// send contents of the mmap() frame buffer
+static int commit_frame(struct p44ledchain_commit *aCommit, devPtr_t dev)
+{
+  int newPatterns;
+
+  newPatterns = prepare_commit(aCommit, 1, dev);
+  if (newPatterns<0) return newPatterns;
+  if (newPatterns>0) scheduleNewPatterns(newPatterns, dev);
+  return 0;
+}
+
+
+// send contents of the mmap() frame buffers of multiple chains, starting them at the same time
+static int commit_group(struct file *filp, struct p44ledchain_group_commit *aGroup, long long aSubmittedAt)
+{
+  int newPatterns[NUM_DEVICES];
+  devPtr_t dev;
+  int ch;
+  int ret = 0;
+
+  if (aGroup->channels==0 || (aGroup->channels & ~((1<<NUM_DEVICES)-1))) return -EINVAL;
+  for (ch=0; ch<NUM_DEVICES; ch++) {
+    if (!(aGroup->channels & (1<<ch))) continue;
+    if (!p44ledchain_devices[ch]) return -ENODEV;
+    // variable led type mode, but no type set by a write() so far
+    if (!p44ledchain_devices[ch]->ledLayoutDesc) return -EINVAL;
+  }
+  // all chains must be idle to start them together
+  for (ch=0; ch<NUM_DEVICES; ch++) {
+    if (!(aGroup->channels & (1<<ch))) continue;
+    ret = waitForIdle(filp, p44ledchain_devices[ch]);
+    if (ret) return ret;
+  }
+  // generate patterns for all chains
+  for (ch=0; ch<NUM_DEVICES; ch++) {
+    newPatterns[ch] = 0;
+    if (!(aGroup->channels & (1<<ch))) continue;
+    dev = p44ledchain_devices[ch];
+    mutex_lock_nested(&dev->writelock, ch);
+    dev->submittedAt = aSubmittedAt;
+    newPatterns[ch] = prepare_commit(&aGroup->commit[ch], 0, dev); // chains must start together
+    if (newPatterns[ch]<0) ret = newPatterns[ch];
+  }
+  // start them all at once
+  if (ret==0) startSendingGroup(aGroup->channels, newPatterns);
+  for (ch=NUM_DEVICES-1; ch>=0; ch--) {
+    if (aGroup->channels & (1<<ch)) mutex_unlock(&p44ledchain_devices[ch]->writelock);
+  }
+  if (ret==0 && (aGroup->flags & P44LEDCHAIN_GROUP_WAIT)) {
+    // report completion only when all chains are done
+    for (ch=0; ch<NUM_DEVICES && ret==0; ch++) {
+      if (aGroup->channels & (1<<ch)) ret = wait_event_interruptible(p44ledchain_devices[ch]->readywait, isIdle(p44ledchain_devices[ch]));
+    }
+  }
+  return ret;
+}
+
+
+// queue contents of the mmap() frame buffer for sending at a given time
+static int queue_frame(struct p44ledchain_queue *aQueue, devPtr_t dev)
+{
+  PatternBuffer_t *pb;
+  unsigned long irqflags;
+  int leds;
+  long long startedAt;
+
+  if (!dev->ledLayoutDesc) {
+    // variable led type mode, but no type set by a write() so far
+    return -EINVAL;
+  }
+  if (dev->maxTPassiveNs==0) dev->maxTPassiveNs = dev->ledChipDesc->TPassive_max_nS; // 0 = use chip's  default
+  leds = frame_leds(&aQueue->commit, dev);
+  // take a free buffer (only writers holding writelock take them, so if there is one, it stays available)
+  spin_lock_irqsave(&dev->updatelock, irqflags);
+  pb = dev->numFree>0 ? dev->freeBufs[--dev->numFree] : NULL;
+  spin_unlock_irqrestore(&dev->updatelock, irqflags);
+  if (!pb) return -EAGAIN;
+  // always generate entire frame, timed frames are not related to the most recent frame
+  startedAt = ktime_to_ns(ktime_get());
+  pb->numPatterns = generatePatterns(dev->mapBuf, 0, leds, pb, dev);
+  recordEncodeTime(startedAt, leds, dev);
+  pb->validLeds = 0;
+  pb->submittedAt = dev->submittedAt;
+  pb->startAt = aQueue->start_ns;
+  pb->frameId = aQueue->frame_id;
+  // from now on, the chain might not show the most recent frame any more
+  dev->frameObscured = 1;
+  queueNewPatterns(pb, dev);
+  return 0;
+}
+
+
+static long p44ledchain_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+  devPtr_t dev = (devPtr_t)filp->private_data;
+  struct p44ledchain_commit commit;
+  struct p44ledchain_queue queue;
+  struct p44ledchain_presented presented;
+  struct p44ledchain_group_commit group;
+  struct p44ledchain_calibration *calib;
+  struct p44ledchain_correction *corr;
+  struct p44ledchain_config config;
+  struct p44ledchain_stats stats;
+  long ret;
+  long long submittedAt = ktime_to_ns(ktime_get());
+
+  switch (cmd) {
+    case P44LEDCHAIN_IOC_GET_MAPSIZE:
+      return put_user(dev->mapBufSize, (__u32 __user *)arg);
+    case P44LEDCHAIN_IOC_COMMIT:
+      if (arg && copy_from_user(&commit, (void __user *)arg, sizeof(commit))) {
+        return -EFAULT;
+      }
+      ret = waitForNewPatterns(filp, dev);
+      if (ret) return ret;
+      mutex_lock(&dev->writelock);
+      dev->submittedAt = submittedAt;
+      ret = commit_frame(arg ? &commit : NULL, dev);
+      mutex_unlock(&dev->writelock);
+      return ret;
+    case P44LEDCHAIN_IOC_GET_STATS:
+      getStats(&stats, dev);
+      return copy_to_user((void __user *)arg, &stats, sizeof(stats)) ? -EFAULT : 0;
+    case P44LEDCHAIN_IOC_RESET_STATS:
+      resetStats(dev);
+      return 0;
+    case P44LEDCHAIN_IOC_GET_READY:
+      return put_user((__u32)isReady(dev), (__u32 __user *)arg);
+    case P44LEDCHAIN_IOC_QUEUE_FRAME:
+      if (copy_from_user(&queue, (void __user *)arg, sizeof(queue))) {
+        return -EFAULT;
+      }
+      while (1) {
+        ret = waitForQueueSpace(filp, dev);
+        if (ret) return ret;
+        mutex_lock(&dev->writelock);
+        if (canQueueFrame(dev)) break;
+        // another writer has taken the free buffer meanwhile, wait again
+        mutex_unlock(&dev->writelock);
+      }
+      dev->submittedAt = submittedAt;
+      ret = queue_frame(&queue, dev);
+      mutex_unlock(&dev->writelock);
+      return ret;
+    case P44LEDCHAIN_IOC_GET_PRESENTED:
+      if (!getPresented(&presented, dev)) return -EAGAIN;
+      return copy_to_user((void __user *)arg, &presented, sizeof(presented)) ? -EFAULT : 0;
+    case P44LEDCHAIN_IOC_COMMIT_GROUP:
+      if (copy_from_user(&group, (void __user *)arg, sizeof(group))) {
+        return -EFAULT;
+      }
+      return commit_group(filp, &group, submittedAt);
+    case P44LEDCHAIN_IOC_CALIBRATE:
+      calib = kmalloc(sizeof(*calib), GFP_KERNEL);
+      if (!calib) return -ENOMEM;
+      if (copy_from_user(calib, (void __user *)arg, sizeof(*calib))) {
+        kfree(calib);
+        return -EFAULT;
+      }
+      mutex_lock(&dev->writelock);
+      ret = calibrate(calib, dev);
+      mutex_unlock(&dev->writelock);
+      if (ret==0 && copy_to_user((void __user *)arg, calib, sizeof(*calib))) ret = -EFAULT;
+      kfree(calib);
+      return ret;
+    case P44LEDCHAIN_IOC_SET_CORRECTION:
+      corr = kmalloc(sizeof(*corr), GFP_KERNEL);
+      if (!corr) return -ENOMEM;
+      if (copy_from_user(corr, (void __user *)arg, sizeof(*corr))) {
+        kfree(corr);
+        return -EFAULT;
+      }
+      mutex_lock(&dev->writelock);
+      setCorrection(corr, dev);
+      mutex_unlock(&dev->writelock);
+      kfree(corr);
+      return 0;
+    case P44LEDCHAIN_IOC_SET_PALETTE:
+      mutex_lock(&dev->writelock);
+      ret = copy_from_user(&dev->palette, (void __user *)arg, sizeof(dev->palette)) ? -EFAULT : 0;
+      mutex_unlock(&dev->writelock);
+      return ret;
+    case P44LEDCHAIN_IOC_GET_CORRECTION:
+      // Note: no lock, copying a correction being changed concurrently may return a mix of old and new values
+      return copy_to_user((void __user *)arg, &dev->correction, sizeof(dev->correction)) ? -EFAULT : 0;
+    case P44LEDCHAIN_IOC_GET_CONFIG:
+      mutex_lock(&dev->writelock);
+      getConfig(&config, dev);
+      mutex_unlock(&dev->writelock);
+      return copy_to_user((void __user *)arg, &config, sizeof(config)) ? -EFAULT : 0;
+    case P44LEDCHAIN_IOC_SET_CONFIG:
+      if (copy_from_user(&config, (void __user *)arg, sizeof(config))) {
+        return -EFAULT;
+      }
+      mutex_lock(&dev->writelock);
+      ret = setConfig(filp, &config, dev);
+      mutex_unlock(&dev->writelock);
+      return ret;
+    default:
+      return -ENOTTY;
+  }
+}
+
+
+// MARK: ===== debugfs timing statistics
+
+static void showHistogram(struct seq_file *m, const Histogram_t *aHist)
+{
+  int b;
+
+  seq_printf(m, "%s:\n", aHist->name);
+  for (b=0; b<LEDCHAIN_HIST_BUCKETS; b++) {
+    if (b==0)
+      seq_printf(m, "  %10u..%-10u : %u\n", 0, (1<<aHist->shift)-1, aHist->counts[b]);
+    else if (b<LEDCHAIN_HIST_BUCKETS-1)
+      seq_printf(m, "  %10u..%-10u : %u\n", 1<<(aHist->shift+b-1), (1<<(aHist->shift+b))-1, aHist->counts[b]);
+    else
+      seq_printf(m, "  %10u..%-10s : %u\n", 1<<(aHist->shift+b-1), "", aHist->counts[b]);
+  }
+}
+
+
+static int p44ledchain_timing_show(struct seq_file *m, void *v)
+{
+  devPtr_t dev = (devPtr_t)m->private;
+  Histogram_t hists[4];
+  u32 lastEncode, maxEncode, lastLatency, maxLatency;
+  unsigned long irqflags;
+  int i;
+
+  // get consistent snapshot
+  spin_lock_irqsave(&dev->updatelock, irqflags);
+  hists[0] = dev->hist_irq_delay;
+  hists[1] = dev->hist_timeout_pattern;
+  hists[2] = dev->hist_encode;
+  hists[3] = dev->hist_latency;
+  lastEncode = dev->last_encode_ns;
+  maxEncode = dev->max_encode_ns;
+  lastLatency = dev->last_latency_us;
+  maxLatency = dev->max_latency_us;
+  spin_unlock_irqrestore(&dev->updatelock, irqflags);
+  seq_printf(m, "Encode time: last=%unS, max=%unS\n", lastEncode, maxEncode);
+  seq_printf(m, "Submit to latch latency: last=%uuS, max=%uuS\n", lastLatency, maxLatency);
+  for (i=0; i<4; i++) showHistogram(m, &hists[i]);
+  return 0;
+}
+
+
+static int p44ledchain_timing_open(struct inode *inode, struct file *filp)
+{
+  return single_open(filp, p44ledchain_timing_show, inode->i_private);
+}
+
+
+// reset timing statistics
+static void resetTiming(devPtr_t dev)
+{
+  unsigned long irqflags;
+
+  spin_lock_irqsave(&dev->updatelock, irqflags);
+  memset(dev->hist_irq_delay.counts, 0, sizeof(dev->hist_irq_delay.counts));
+  memset(dev->hist_timeout_pattern.counts, 0, sizeof(dev->hist_timeout_pattern.counts));
+  memset(dev->hist_encode.counts, 0, sizeof(dev->hist_encode.counts));
+  memset(dev->hist_latency.counts, 0, sizeof(dev->hist_latency.counts));
+  dev->max_encode_ns = 0;
+  dev->max_latency_us = 0;
+  spin_unlock_irqrestore(&dev->updatelock, irqflags);
+}
+
+
+static ssize_t p44ledchain_reset_write(struct file *filp, const char __user *buff, size_t len, loff_t *off)
+{
+  // writing anything resets
+  resetTiming((devPtr_t)filp->private_data);
   return len;
 }
 
 
+static const struct file_operations p44ledchain_timing_fops = {
+  .owner = THIS_MODULE,
+  .open = p44ledchain_timing_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
+static const struct file_operations p44ledchain_reset_fops = {
+  .owner = THIS_MODULE,
+  .open = simple_open,
+  .write = p44ledchain_reset_write,
+};
+
+
+static void p44ledchain_add_debugfs(const char *devname, devPtr_t dev)
+{
+  dev->hist_irq_delay.name = "IRQ delay [nS]";
+  dev->hist_irq_delay.shift = 9;
+  dev->hist_timeout_pattern.name = "Pattern index of timeouts";
+  dev->hist_timeout_pattern.shift = 0;
+  dev->hist_encode.name = "Encode time [nS]";
+  dev->hist_encode.shift = 12;
+  dev->hist_latency.name = "Submit to latch latency [uS]";
+  dev->hist_latency.shift = 6;
+  // Note: debugfs errors are not fatal, the driver works without
+  dev->debugfs_dir = debugfs_create_dir(devname, p44ledchain_debugfs_root);
+  debugfs_create_file("timing", 0444, dev->debugfs_dir, dev, &p44ledchain_timing_fops);
+  debugfs_create_file("reset", 0200, dev->debugfs_dir, dev, &p44ledchain_reset_fops);
+}
+
+
 // MARK: ===== device init and cleanup
 
 
@@ -1031,9 +2742,12 @@ static int p44ledchain_add_device(struct class *class, int minor, devPtr_t *devP
 {
   int err;
   int pval;
+  int i;
 	struct device *device = NULL;
 	devPtr_t dev = NULL;
 	u16 ltyp;
+	LedLayout_t layoutType;
+	LedChip_t chipType;
 
 	BUG_ON(class==NULL || devP==NULL);
 
@@ -1064,48 +2778,17 @@ static int p44ledchain_add_device(struct class *class, int minor, devPtr_t *devP
     goto err_free;
   }
   dev->num_leds = pval;
-  // - LED type: can be either:
-  //   - MSB==0 -> LSB=one of the old predefined types
-  //   - MSB!=0 -> MSB=layout, LSB=chip
+  // - LED type
   ltyp = ledtype_ws2812; // standard
   if (LEDCHAIN_PARAM_LEDTYPE<param_count) {
     ltyp = (u16)params[LEDCHAIN_PARAM_LEDTYPE];
-    if ((ltyp&ledtype_layout_mask)!=0) {
-      // direct specification of layout and type
-      dev->layoutType = (ltyp&ledtype_layout_mask)>>8;
-      dev->chipType = ltyp&ledtype_chip_mask;
-      if (dev->layoutType>=num_ledlayouts) {
-        printk(KERN_WARNING LOGPREFIX "MSB of LED type is layout type and must be 1..%d for %s\n", num_ledlayouts-1, devname);
-        err = -EINVAL;
-        goto err_free;
-      }
-      else if (dev->chipType==0 || dev->chipType>=num_ledchips) {
-        printk(KERN_WARNING LOGPREFIX "LSB of LED type is chip type and must be 1..%d for %s\n", num_ledchips-1, devname);
-        err = -EINVAL;
-        goto err_free;
-      }
-    }
-    else {
-      // indirect specification of layout and type via legacy led types
-      if (ltyp==ledtype_variable) {
-        dev->layoutType = ledlayout_none; // signals layout+chip are determined by data for every update
-      }
-      else {
-        if (ltyp>=num_predef_ledtypes) {
-          printk(KERN_WARNING LOGPREFIX "LED type must be 0..%d or 255 for %s\n", num_predef_ledtypes-1, devname);
-          err = -EINVAL;
-          goto err_free;
-        }
-        dev->layoutType = predefLedTypeDescriptors[ltyp].layout;
-        dev->chipType = predefLedTypeDescriptors[ltyp].chip;
-      }
-    }
-  }
-  if (dev->layoutType!=ledlayout_none) {
-    // led type and layout is fixed for the device, can set descriptor pointers now
-    dev->ledChipDesc = &ledChipDescriptors[dev->chipType-1];
-    dev->ledLayoutDesc = &ledLayoutDescriptors[dev->layoutType-1];
   }
+  err = parseLedType(ltyp, &layoutType, &chipType, devname);
+  if (err) goto err_free;
+  setLedType(ltyp, layoutType, chipType, dev);
+  // - refill mode
+  dev->earlyRefill = earlyrefill!=0;
+  dev->hwRepeat = hwrepeat!=0;
   // - retries
   dev->maxSendRetries = DEFAULT_MAX_RETRIES;
   if (LEDCHAIN_PARAM_MAXRETRIES<param_count) {
@@ -1121,25 +2804,34 @@ static int p44ledchain_add_device(struct class *class, int minor, devPtr_t *devP
   dev->maxTPassiveNs = 0; // indicates no custom value set
   if (LEDCHAIN_PARAM_MAXTPASSIVE<param_count) {
     pval = params[LEDCHAIN_PARAM_MAXTPASSIVE];
-    if (pval<MIN_MAXTPASSIVE_NS) {
+    if (pval>0 && pval<MIN_MAXTPASSIVE_NS) {
+      // Note: 0 means chip default, needed as placeholder when maxpollleds is specified
       printk(KERN_WARNING LOGPREFIX "max passive time < %dnS is unlikely to work for %s\n", MIN_MAXTPASSIVE_NS, devname);
     }
     dev->maxTPassiveNs = pval;
   }
-  // allocate the buffer for the LED data
-  dev->outBufSize =
-    dev->num_leds // = number of leds
-    * (dev->ledLayoutDesc ? dev->ledLayoutDesc->channels : 4) // * channels (always assume 4 in case of variable layout)
-    * 8 // * number of bits = number of LED bits to send max
-    * 3 // * number of PWM bits per payload bits (max) = number of PWM bits total
-    / 64 // number of PWM patterns
-    * sizeof(PWMPattern_t);
-  dev->outBuf = kzalloc(dev->outBufSize, GFP_KERNEL);
-  if (!dev->outBuf) {
-    printk(KERN_WARNING LOGPREFIX "Cannot allocate PWM data buffer of %d bytes for %s\n", dev->outBufSize, devname);
-    err = -ENOMEM;
-    goto err_free;
+  // - busy polling for short frames
+  dev->maxPollLeds = 0;
+  if (LEDCHAIN_PARAM_MAXPOLLLEDS<param_count) {
+    pval = params[LEDCHAIN_PARAM_MAXPOLLLEDS];
+    if (pval>LEDCHAIN_MAX_POLL_LEDS) {
+      printk(KERN_WARNING LOGPREFIX "busy polling limited to %d LEDs for %s\n", LEDCHAIN_MAX_POLL_LEDS, devname);
+      pval = LEDCHAIN_MAX_POLL_LEDS;
+    }
+    dev->maxPollLeds = pval;
   }
+  // init the locks
+  spin_lock_init(&dev->updatelock);
+  mutex_init(&dev->writelock);
+  init_waitqueue_head(&dev->readywait);
+  atomic_set(&dev->mapCount, 0);
+  // allocate the buffers (always assume 4 channels in case of variable layout)
+  err = allocBuffers(dev->num_leds, dev->ledLayoutDesc ? dev->ledLayoutDesc->channels : 4, dev->ledChipDesc, dev);
+  if (err) goto err_free_buffer;
+  dev->sendBuf = &dev->patternBufs[0];
+  dev->genBuf = &dev->patternBufs[1];
+  initCorrection(dev);
+  for (i=2; i<dev->numPatternBufs; i++) dev->freeBufs[dev->numFree++] = &dev->patternBufs[i];
   // register cdev
   // - init the struct contained in our dev struct
   cdev_init(&dev->cdev, &p44ledchain_fops);
@@ -1161,23 +2853,22 @@ static int p44ledchain_add_device(struct class *class, int minor, devPtr_t *devP
 		printk(KERN_WARNING LOGPREFIX "Error %d while trying to create %s\n", err, devname);
 		goto err_free_cdev;
 	}
-  // init the lock
-  spin_lock_init(&dev->updatelock);
   // init the timer
   hrtimer_init(&dev->starttimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
   dev->starttimer.function = p44ledchain_timer_func;
   // init update time statistics
-  dev->max_update_us = 0;
-  dev->min_update_us = 10000000; // ten seconds
+  resetStats(dev);
+  p44ledchain_add_debugfs(devname, dev);
   // Config summary
   printk(KERN_INFO LOGPREFIX "v%d - Device: /dev/%s\n", P44LEDCHAIN_VERSION, devname);
   printk(KERN_INFO LOGPREFIX "- PWM channel    : %d\n", dev->pwm_channel);
-  printk(KERN_INFO LOGPREFIX "- PWM buffer size: %u\n", dev->outBufSize);
+  printk(KERN_INFO LOGPREFIX "- PWM buffer size: %d*%u bytes\n", dev->numPatternBufs, dev->outBufSize);
   printk(KERN_INFO LOGPREFIX "- Number of LEDs : %d\n", dev->num_leds);
   printk(KERN_INFO LOGPREFIX "- Inverted       : %d\n", dev->inverted);
   printk(KERN_INFO LOGPREFIX "- LED type       : %s %s\n", (dev->ledChipDesc ? dev->ledChipDesc->name : "<variable>"), (dev->ledLayoutDesc ? dev->ledLayoutDesc->name : ""));
   printk(KERN_INFO LOGPREFIX "- Max retries    : %d\n", dev->maxSendRetries);
   printk(KERN_INFO LOGPREFIX "- Max Tpassive   : %d nS (0=chip default)\n", dev->maxTPassiveNs);
+  printk(KERN_INFO LOGPREFIX "- Max poll LEDs  : %d (0=always use IRQ)\n", dev->maxPollLeds);
   // done
   *devP = dev; // pass back new dev
   return 0;
@@ -1185,7 +2876,7 @@ static int p44ledchain_add_device(struct class *class, int minor, devPtr_t *devP
 err_free_cdev:
   cdev_del(&dev->cdev);
 err_free_buffer:
-  kfree(dev->outBuf);
+  freeBuffers(dev);
 err_free:
   kfree(dev);
 err:
@@ -1205,14 +2896,15 @@ static void p44ledchain_remove_device(struct class *class, int minor, devPtr_t *
 	stopSendingPatterns(dev);
 	hrtimer_cancel(&dev->starttimer);
 	// disable PWM interrupts
-  intEnable = ioread32(PWM_INT_ENABLE); // currently enabled PWM IRQs
-  iowrite32(intEnable & ~((PWM_IRQ_FINISH|PWM_IRQ_UNDERFLOW)<<(dev->pwm_channel*2)), PWM_INT_ENABLE); // disable interrupts of this channel
+  intEnable = pwm_read(PWM_INT_ENABLE); // currently enabled PWM IRQs
+  pwm_write(intEnable & ~((PWM_IRQ_FINISH|PWM_IRQ_UNDERFLOW)<<(dev->pwm_channel*2)), PWM_INT_ENABLE); // disable interrupts of this channel
+	debugfs_remove_recursive(dev->debugfs_dir);
 	// destroy device
 	device_destroy(class, MKDEV(p44ledchain_major, minor));
 	// delete cdev
 	cdev_del(&dev->cdev);
-	// delete buffer
-  kfree(dev->outBuf);
+	// delete buffers
+  freeBuffers(dev);
   // delete dev
   kfree(dev);
   *devP = NULL;
@@ -1229,7 +2921,6 @@ static int __init p44ledchain_init_module(void)
   int i;
   dev_t devno;
 
-  SEQ_TRACE_CLEAR()
   // no devices to begin with
   for (i=0; i<NUM_DEVICES; i++) {
     p44ledchain_devices[i] = NULL;
@@ -1239,6 +2930,11 @@ static int __init p44ledchain_init_module(void)
     printk(KERN_WARNING LOGPREFIX "must specify at least one PWM driven LED chain\n");
 		err = -EINVAL;
 		goto err;
+  }
+  if (framequeue<0 || framequeue>LEDCHAIN_MAX_FRAMEQUEUE) {
+    printk(KERN_WARNING LOGPREFIX "framequeue must be 0..%d\n", LEDCHAIN_MAX_FRAMEQUEUE);
+    err = -EINVAL;
+    goto err;
   }
 	// Get a range of minor numbers (starting with 0) to work with */
 	err = alloc_chrdev_region(&devno, 0, NUM_DEVICES, DEVICE_NAME);
@@ -1253,24 +2949,12 @@ static int __init p44ledchain_init_module(void)
 		err = PTR_ERR(p44ledchain_class);
 		goto err_unregister_region;
 	}
-  // map PWM registers
-  // TODO: should also do request_mem_region()
-  pwm_base = ioremap(MT7688_PWM_BASE, MT7688_PWM_SIZE);
-  printk(KERN_INFO DEVICE_NAME": pwm_base=0x%08X\n", (u32)pwm_base);
-  // request the IRQ
-  // FIXME: for now, we just KNOW the IRQ
-  pwm_irq_no = 8+26; // Undocumented in MT7688 datasheet, but is same as mentioned in MT7628 datasheet IRQ channel table (8=CPU IRQ offset, 26=IRQ number in interrupt controller)
-  err = request_any_context_irq(
-    pwm_irq_no,
-    p44ledchain_pwm_interrupt,
-    IRQF_SHARED , // the IRQ is shared between all PWM channels
-    "pwm-irq",
-    p44ledchain_devices // array of all 4 possible devices
-  );
-  if (err!=IRQC_IS_HARDIRQ) {
-    printk(KERN_WARNING LOGPREFIX "registering IRQ %d failed (or not hardIRQ) for PWM, err=%d\n", pwm_irq_no, err);
-    goto err_unmap;
-  }
+  // make PWM unit accessible and request the IRQ
+  err = pwm_init(p44ledchain_pwm_interrupt, p44ledchain_devices); // array of all 4 possible devices
+  if (err) goto err_destroy_class;
+  // debugfs directory for timing statistics
+  p44ledchain_debugfs_root = debugfs_create_dir(DEVICE_NAME, NULL);
+  pwm_add_debugfs(p44ledchain_debugfs_root);
   // instantiate devices from module params
   if (ledchain0_argc>0) {
     err = p44ledchain_add_device(p44ledchain_class, 0, &(p44ledchain_devices[0]), ledchain0, ledchain0_argc, "ledchain0");
@@ -1294,11 +2978,10 @@ err_destroy_devices:
   for (i=0; i<NUM_DEVICES; i++) {
     p44ledchain_remove_device(p44ledchain_class, i, &(p44ledchain_devices[i]));
   }
-//err_free_irq:
-  free_irq(pwm_irq_no, p44ledchain_devices);
-err_unmap:
-  iounmap(pwm_base);
-//err_destroy_class:
+  debugfs_remove_recursive(p44ledchain_debugfs_root);
+//err_pwm_exit:
+  pwm_exit(p44ledchain_devices);
+err_destroy_class:
   class_destroy(p44ledchain_class);
 err_unregister_region:
   unregister_chrdev_region(MKDEV(p44ledchain_major, 0), NUM_DEVICES);
@@ -1316,10 +2999,9 @@ static void __exit p44ledchain_exit_module(void)
   for (i=0; i<NUM_DEVICES; i++) {
     p44ledchain_remove_device(p44ledchain_class, i, &(p44ledchain_devices[i]));
   }
-  // free the IRQ
-  free_irq(pwm_irq_no, p44ledchain_devices);
-  // unmap PWM
-  iounmap(pwm_base);
+  debugfs_remove_recursive(p44ledchain_debugfs_root);
+  // free the IRQ, release PWM unit
+  pwm_exit(p44ledchain_devices);
   // destroy the class
   class_destroy(p44ledchain_class);
   // unregister the region
@@ -0,0 +1,263 @@
+/*
+ *  p44-ledchain.h - ioctl interface of the p44-ledchain kernel module
+ *
+ *  Copyright (C) 2017-2021 Lukas Zeller <luz@plan44.ch>
+ *
+ *  This is free software, licensed under the GNU General Public License v2.
+ *  See /LICENSE for more information.
+ *
+ */
+
+#ifndef __P44_LEDCHAIN_H__
+#define __P44_LEDCHAIN_H__
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define P44LEDCHAIN_IOC_MAGIC 'L'
+
+
+// MARK: ===== mmap() frame buffer
+
+// The ledchain device can be mmap()ed (offset 0, up to the size returned by P44LEDCHAIN_IOC_GET_MAPSIZE).
+// The mapped buffer holds the LED data in the same format as written to the device, but without
+// any header (in variable led type mode, the led type of the last write() applies).
+// After modifying LED data in the buffer, P44LEDCHAIN_IOC_COMMIT must be used to send it to the chain.
+
+struct p44ledchain_commit {
+  __u32 leds; ///< number of LEDs in the frame buffer to send, 0 = all
+  __u32 dirty_first; ///< first LED changed since the previous frame
+  __u32 dirty_count; ///< number of LEDs changed since the previous frame, P44LEDCHAIN_DIRTY_UNKNOWN = compare with previous frame
+};
+
+#define P44LEDCHAIN_DIRTY_UNKNOWN 0xFFFFFFFF
+
+// get size of the mmap() frame buffer in bytes (__u32)
+#define P44LEDCHAIN_IOC_GET_MAPSIZE _IOR(P44LEDCHAIN_IOC_MAGIC, 1, __u32)
+// send frame buffer contents to the chain. Argument can be NULL to send all LEDs, comparing with previous frame
+#define P44LEDCHAIN_IOC_COMMIT _IOW(P44LEDCHAIN_IOC_MAGIC, 2, struct p44ledchain_commit)
+
+
+// MARK: ===== status and statistics
+
+struct p44ledchain_stats {
+  __u32 ready; ///< 1 if ready (no update in progress), 0 if busy
+  // last update
+  __u32 last_retries; ///< number of retries needed for the last update
+  __u32 last_timeout_ns; ///< last IRQ delay that triggered a retry
+  __u32 min_irq_delay_ns; ///< min IRQ delay during last update
+  __u32 max_irq_delay_ns; ///< max IRQ delay during last update that did not trigger a retry
+  __u32 last_update_us; ///< duration of the last update
+  // totals
+  __u32 updates; ///< number of updates sent
+  __u32 overruns; ///< number of updates abandoned in favour of newer data
+  __u32 superseded; ///< number of updates replaced by newer data before being sent
+  __u32 skipped; ///< number of updates not sent because data was identical
+  __u32 retries; ///< number of retries
+  __u32 errors; ///< number of updates given up after max retries
+  __u32 irq_count; ///< number of PWM IRQs handled
+  __u32 min_update_us; ///< min duration of a complete update
+  __u32 max_update_us; ///< max duration of a complete update
+  // timed frames
+  __u32 queued; ///< number of timed frames currently queued
+  __u32 timed_frames; ///< number of timed frames started
+  __u32 last_lateness_ns; ///< how late the last timed frame started
+  __u32 max_lateness_ns; ///< max lateness of a timed frame
+  // timing parameters
+  __u32 max_tpassive_ns; ///< max passive time currently in use (0 = chip default, until first update)
+  __u32 max_retries; ///< max retries currently in use
+  __u32 calib_tpassive_ns; ///< max passive time found by last calibration, 0 if none
+  __u32 calib_retries; ///< max retries found by last calibration
+  // refill mode
+  __u32 early_refill; ///< 1 if next pattern is loaded on underflow IRQ while current one is still being sent
+  __u32 min_refill_slack_ns; ///< early refill: min time left before the end of the current pattern when refilling during last update
+  __u32 refill_fallbacks; ///< number of times early refill did not work and driver fell back to refill after finish IRQ
+  __u32 hw_repeat; ///< 1 if runs of identical patterns are sent by letting the PWM repeat the wave
+  __u32 repeated; ///< number of patterns sent as repeated waves, without an IRQ of their own
+  // busy polling
+  __u32 max_poll_leds; ///< frames with up to this number of LEDs are sent by busy polling with IRQs disabled, 0 = never
+  __u32 polled_frames; ///< number of frames (including retries) sent by busy polling
+  __u32 last_irqoff_us; ///< time IRQs were disabled for sending the last polled frame
+  __u32 max_irqoff_us; ///< max time IRQs were disabled for sending a polled frame
+  // buffers
+  __u32 pattern_bufs; ///< number of PWM pattern buffers (front, back and timed frames)
+  __u32 pattern_buf_size; ///< size of each PWM pattern buffer in bytes (worst case for the LED type and number of LEDs)
+  __u32 pattern_buf_peak; ///< max number of bytes used in a PWM pattern buffer
+  // pipelined encoding
+  __u32 pipeline; ///< 1 if sending a frame can start while the rest of it is still being encoded
+  __u32 pipelined_frames; ///< number of frames started before they were completely encoded
+  __u32 pipeline_underruns; ///< number of times sending caught up with encoding (frame is resent, should not happen)
+  __u32 last_lead_ns; ///< min time the encoder was ahead of sending during the last pipelined frame
+  __u32 min_lead_ns; ///< min time the encoder was ahead of sending in any pipelined frame
+};
+
+// get status and statistics (struct p44ledchain_stats)
+#define P44LEDCHAIN_IOC_GET_STATS _IOR(P44LEDCHAIN_IOC_MAGIC, 3, struct p44ledchain_stats)
+// reset statistics totals
+#define P44LEDCHAIN_IOC_RESET_STATS _IO(P44LEDCHAIN_IOC_MAGIC, 4)
+// get ready status (__u32, 1 if ready, 0 if busy)
+#define P44LEDCHAIN_IOC_GET_READY _IOR(P44LEDCHAIN_IOC_MAGIC, 5, __u32)
+
+
+
+// MARK: ===== timed frames
+
+// The contents of the mmap() frame buffer can be queued to start sending at a given CLOCK_MONOTONIC time.
+// Frames are encoded when queued, so the frame buffer can be modified for the next frame right afterwards.
+// A timed frame starts sending at its start time, or as soon as the chain has latched the previous data
+// if that is later. When several queued frames are due at once, only the latest is sent.
+
+struct p44ledchain_queue {
+  struct p44ledchain_commit commit; ///< LEDs to send (dirty range is ignored, timed frames are always encoded entirely)
+  __u64 start_ns; ///< CLOCK_MONOTONIC time in nS when the frame should start sending, 0 = as soon as possible
+  __u32 frame_id; ///< caller's id for the frame, reported back in struct p44ledchain_presented
+  __u32 reserved;
+};
+
+struct p44ledchain_presented {
+  __u32 frame_id; ///< id of the timed frame
+  __u32 lateness_ns; ///< how late the frame started sending
+  __u64 started_ns; ///< CLOCK_MONOTONIC time in nS when the frame started sending
+};
+
+// queue frame buffer contents for sending at a given time (struct p44ledchain_queue).
+// Blocks while the queue is full (EAGAIN with O_NONBLOCK)
+#define P44LEDCHAIN_IOC_QUEUE_FRAME _IOW(P44LEDCHAIN_IOC_MAGIC, 6, struct p44ledchain_queue)
+// get oldest not yet retrieved record of a started timed frame (struct p44ledchain_presented), EAGAIN if none
+#define P44LEDCHAIN_IOC_GET_PRESENTED _IOR(P44LEDCHAIN_IOC_MAGIC, 7, struct p44ledchain_presented)
+
+
+
+// MARK: ===== synchronized multi-chain update
+
+// The mmap() frame buffers of several ledchain devices can be committed with a single call on any
+// of the ledchain devices. The driver waits until all involved chains are idle, generates the patterns
+// for all of them and then enables their PWMs at the same time, so the chains start sending in sync.
+
+#define P44LEDCHAIN_NUM_CHANNELS 4
+
+struct p44ledchain_group_commit {
+  __u32 channels; ///< bit mask of the PWM channels (ledchain devices) to update
+  __u32 flags; ///< P44LEDCHAIN_GROUP_xxx flags
+  struct p44ledchain_commit commit[P44LEDCHAIN_NUM_CHANNELS]; ///< what to send, per channel
+};
+
+#define P44LEDCHAIN_GROUP_WAIT 0x01 ///< return only after all chains have completely sent their frame
+
+// commit frame buffers of multiple chains and start sending them at the same time (struct p44ledchain_group_commit)
+// Blocks until all involved chains are idle (EAGAIN with O_NONBLOCK)
+#define P44LEDCHAIN_IOC_COMMIT_GROUP _IOW(P44LEDCHAIN_IOC_MAGIC, 8, struct p44ledchain_group_commit)
+
+
+
+// MARK: ===== timing calibration
+
+// Calibration sweeps the max passive time from max_tpassive_ns down to min_tpassive_ns, sending the most
+// recent frame (which must have been sent before) repeatedly with a generous retry budget at every step.
+// It stops at the first step where frames had to be given up. The result is the lowest max passive time
+// (most safety margin against early latching of the LED chips) that completed all frames without being
+// more than 10% slower than the fastest step because of retries, and the retries needed for it
+// (one more than the max seen in that step, but not less than the driver's default of 3).
+
+#define P44LEDCHAIN_CALIBRATION_STEPS 16
+
+struct p44ledchain_calibration_step {
+  __u32 max_tpassive_ns; ///< max passive time tested in this step
+  __u32 frames; ///< number of frames sent
+  __u32 errors; ///< number of frames given up
+  __u32 retries; ///< total retries of the frames completed
+  __u32 max_retries; ///< max retries needed for a completed frame
+  __u32 avg_update_us; ///< average duration of the completed frames
+  __u32 max_irq_delay_ns; ///< max IRQ delay that did not trigger a retry
+};
+
+struct p44ledchain_calibration {
+  // parameters (0 = default)
+  __u32 frames; ///< frames to send per step (default: 50, reduced so all steps together send at most 1000 frames)
+  __u32 max_tpassive_ns; ///< start value (default: chip's max passive time)
+  __u32 min_tpassive_ns; ///< end value (default: 5000)
+  __u32 step_ns; ///< step size (default: 1/15 of the range)
+  __u32 retry_budget; ///< max retries during calibration (default: 10)
+  __u32 flags; ///< P44LEDCHAIN_CALIBRATE_xxx flags
+  // results
+  __u32 tpassive_ns; ///< calibrated max passive time, 0 if calibration failed
+  __u32 retries; ///< calibrated max retries
+  __u32 num_steps; ///< number of steps done
+  struct p44ledchain_calibration_step steps[P44LEDCHAIN_CALIBRATION_STEPS];
+};
+
+#define P44LEDCHAIN_CALIBRATE_APPLY 0x01 ///< use calibrated values from now on (otherwise, previous values are restored)
+
+// run calibration (struct p44ledchain_calibration), blocks until done (or EINTR when interrupted by a signal,
+// previous settings remain). ENODATA when no frame was sent so far
+#define P44LEDCHAIN_IOC_CALIBRATE _IOWR(P44LEDCHAIN_IOC_MAGIC, 9, struct p44ledchain_calibration)
+
+
+
+// MARK: ===== color correction
+
+// Gamma, white balance and brightness correction are applied by the driver while generating the PWM patterns,
+// at no extra cost. The output value for input value v of channel c (R,G,B,W, in input data order) is
+// gamma[v]*white_balance[c]/255*brightness/255. Setting the correction sends the most recent frame again
+// with the new correction applied, so a brightness fade does not need new frames. Timed frames already
+// queued keep the correction they were queued with.
+
+struct p44ledchain_correction {
+  __u8 gamma[256]; ///< gamma curve (or any other transfer function), default is identity
+  __u8 white_balance[4]; ///< per channel scaling R,G,B,W, 255 = unchanged (default)
+  __u8 brightness; ///< master brightness, 255 = full (default)
+  __u8 reserved[3];
+};
+
+// set color correction (struct p44ledchain_correction)
+#define P44LEDCHAIN_IOC_SET_CORRECTION _IOW(P44LEDCHAIN_IOC_MAGIC, 10, struct p44ledchain_correction)
+// get color correction (struct p44ledchain_correction)
+#define P44LEDCHAIN_IOC_GET_CORRECTION _IOR(P44LEDCHAIN_IOC_MAGIC, 11, struct p44ledchain_correction)
+
+
+
+// MARK: ===== compact input formats
+
+// In variable LED type mode, byte 6 of the header (header length byte >=6) selects the format of the LED data
+// following the header. Compact formats are expanded by the driver into its copy of the most recent frame;
+// the resulting number of LEDs is the number of LEDs in the new frame (for P44LEDCHAIN_FORMAT_SPARSE,
+// the previous frame is extended when LEDs beyond its end are set).
+
+#define P44LEDCHAIN_FORMAT_RAW 0 ///< one byte per channel per LED (default)
+#define P44LEDCHAIN_FORMAT_PALETTE 1 ///< one byte per LED, index into the palette set with P44LEDCHAIN_IOC_SET_PALETTE
+#define P44LEDCHAIN_FORMAT_RUNS 2 ///< runs of one count byte (1..255) followed by one byte per channel for the color of count LEDs
+#define P44LEDCHAIN_FORMAT_XOR_RUNS 3 ///< like P44LEDCHAIN_FORMAT_RUNS, but colors are XORed with previous frame (which must have the same LED layout)
+#define P44LEDCHAIN_FORMAT_SPARSE 4 ///< list of LED index (2 bytes, MSB first) followed by one byte per channel, other LEDs of previous frame (which must have the same LED layout) remain unchanged
+
+struct p44ledchain_palette {
+  __u8 colors[256][4]; ///< colors in input data order (R,G,B,W), W is ignored for 3 channel LEDs
+};
+
+// set palette for P44LEDCHAIN_FORMAT_PALETTE (struct p44ledchain_palette). Does not affect frames already sent
+#define P44LEDCHAIN_IOC_SET_PALETTE _IOW(P44LEDCHAIN_IOC_MAGIC, 12, struct p44ledchain_palette)
+
+
+
+// MARK: ===== runtime configuration
+
+// The configuration given with the ledchainN module parameter can be changed on a live device.
+// Setting the configuration waits until the chain is idle. When the number of LEDs or the number of channels
+// changes, the buffers are reallocated (EBUSY when the mmap() frame buffer would need to be replaced while
+// it is mapped). A fixed LED type is "sticky": no header is expected in write() data any more.
+// The LEDs keep showing the most recent frame, but the next frame is always sent entirely.
+
+struct p44ledchain_config {
+  __u32 num_leds; ///< number of LEDs in the chain
+  __u32 led_type; ///< LED type, same values as <ledtype> module parameter (255 = variable, type in header of every write())
+  __u32 max_retries; ///< max retries in case of timing failures
+  __u32 max_tpassive_ns; ///< max passive time, 0 = chip default
+  __u32 max_poll_leds; ///< frames with up to this number of LEDs are sent by busy polling with IRQs disabled, 0 = never
+};
+
+// get current configuration (struct p44ledchain_config)
+#define P44LEDCHAIN_IOC_GET_CONFIG _IOR(P44LEDCHAIN_IOC_MAGIC, 13, struct p44ledchain_config)
+// change configuration (struct p44ledchain_config). Blocks until the chain is idle (EAGAIN with O_NONBLOCK)
+#define P44LEDCHAIN_IOC_SET_CONFIG _IOW(P44LEDCHAIN_IOC_MAGIC, 14, struct p44ledchain_config)
+
+
+#endif // __P44_LEDCHAIN_H__
@@ -16,6 +16,12 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <p44-ledchain.h>
 
 #define DEFAULT_NUMLEDS 720
 #define DEFAULT_UPDATEINTERVAL_MS 30
@@ -24,13 +30,14 @@
 #define DEFAULT_COLORSTEP "000000"
 #define DEFAULT_NUMREPEATS 1
 #define DEFAULT_EFFECTINC 1
+#define MAX_SAMPLES 100000 // max samples kept per series for percentiles (random sample of all values beyond that)
 
 static void usage(const char *name)
 {
   fprintf(stderr, "usage:\n");
   fprintf(stderr, "  %s [options] ledchaindevice [ledchaindevice, ...]\n", name);
   fprintf(stderr, "    -n numleds : number of LEDs per chain (default: %d)\n", DEFAULT_NUMLEDS);
-  fprintf(stderr, "    -i interval[ms] : update interval (default: %d)\n", DEFAULT_UPDATEINTERVAL_MS);
+  fprintf(stderr, "    -i interval[ms][,interval...] : update interval, optionally one per chain for -T (default: %d)\n", DEFAULT_UPDATEINTERVAL_MS);
   fprintf(stderr, "    -r repeats : how many repeated updates, 0=continuously, (default: %d)\n", DEFAULT_NUMREPEATS);
   fprintf(stderr, "    -e inc : effect increment, (default: %d)\n", DEFAULT_EFFECTINC);
   fprintf(stderr, "    -c rrggbb : hex color (default: %s)\n", DEFAULT_FGCOLOR);
@@ -41,6 +48,15 @@ static void usage(const char *name)
   fprintf(stderr, "    -F : fill up / empty led chain with foreground color\n");
   fprintf(stderr, "    -S : single wandering LED with foreground color\n");
   fprintf(stderr, "    -v : verbose\n");
+  fprintf(stderr, "    -R : report statistics at end (and on ^C), including driver statistics\n");
+  fprintf(stderr, "    -f text|csv|json : report format (default: text), implies -R\n");
+  fprintf(stderr, "    -T : update chains concurrently, one thread per chain with its own interval\n");
+  fprintf(stderr, "    -P framefile : replay recorded frames from framefile instead of generating them\n");
+  fprintf(stderr, "       (-r then is the number of times the file is replayed, 0=continuously)\n");
+  fprintf(stderr, "    -z bytes : LED data bytes per recorded frame (default: numleds*3)\n");
+  fprintf(stderr, "    -t : every recorded frame is preceded by a 64-bit little endian timestamp in µS\n");
+  fprintf(stderr, "    -E : recorded frames contain a header (length byte + header bytes) for ledchain in variable led type mode\n");
+  fprintf(stderr, "    -X : replay at max speed, ignoring timestamps and interval\n");
 }
 
 
@@ -75,6 +91,7 @@ uint8_t colorstep[3] = { 0, 0, 0};
 int effectinc = DEFAULT_EFFECTINC;
 int repeats = DEFAULT_NUMREPEATS;
 int verbose = 0;
+int threaded = 0;
 
 enum {
   mode_static, // static foreground fill
@@ -83,14 +100,565 @@ enum {
 };
 int mode = mode_static;
 
-const int maxchains = 4;
+enum {
+  report_text,
+  report_csv,
+  report_json
+};
+int report = 0;
+int reportFormat = report_text;
+
+volatile sig_atomic_t stopRequested = 0;
+
+#define MAX_CHAINS 4
+const int maxchains = MAX_CHAINS;
 const int maxhdrlen = 20;
 
+int intervals[MAX_CHAINS]; // per chain intervals for threaded mode
+int numintervals = 0;
+
+int numupdates = 0; // number of updates per chain, 0=continuously
+
+// replay of recorded frames
+const char *replayFile = NULL;
+int frameBytes = 0; // LED data bytes per recorded frame, 0 = numleds*3
+int replayTimestamps = 0; // set if frames are preceded by a timestamp
+int replayHeaders = 0; // set if frames contain a header
+int replayMaxSpeed = 0; // set to replay as fast as possible
+
+
+// MARK: ===== statistics report
+
+// series of samples for percentiles
+typedef struct {
+  uint32_t *values;
+  int count; ///< number of values stored
+  long long seen; ///< number of values added
+  uint32_t max;
+  long long sum;
+} Series_t;
+
+// statistics of one chain
+typedef struct {
+  const char *devName;
+  int hasStats; ///< set if driver statistics are available (P44LEDCHAIN_IOC_GET_STATS)
+  struct p44ledchain_stats startStats; ///< driver statistics at start
+  struct p44ledchain_stats lastStats; ///< most recent driver statistics
+  Series_t writeUs; ///< time write() took
+  Series_t updateUs; ///< driver's duration of every completed update
+  Series_t retries; ///< driver's retries for every completed update
+  Series_t irqDelayNs; ///< driver's max IRQ delay (not causing a retry) of every completed update
+  Series_t lateUs; ///< replay: how late writing a frame started behind its recorded time
+  int loops; ///< number of frames written
+  long long elapsedUs; ///< time the chain was updated
+} ChainStats_t;
+
+// lock for statistics shared between chain threads
+pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void seriesAdd(Series_t *aSeries, uint32_t aValue)
+{
+  long long i;
+
+  if (!aSeries->values) {
+    aSeries->values = malloc(MAX_SAMPLES*sizeof(uint32_t));
+    if (!aSeries->values) return;
+  }
+  if (aValue>aSeries->max) aSeries->max = aValue;
+  aSeries->sum += aValue;
+  aSeries->seen++;
+  if (aSeries->count<MAX_SAMPLES) {
+    aSeries->values[aSeries->count++] = aValue;
+  }
+  else {
+    // reservoir sampling: keep a random sample of all values seen
+    i = random() % aSeries->seen;
+    if (i<MAX_SAMPLES) aSeries->values[i] = aValue;
+  }
+}
+
+
+static int compareValues(const void *a, const void *b)
+{
+  uint32_t va = *(const uint32_t *)a;
+  uint32_t vb = *(const uint32_t *)b;
+  return va<vb ? -1 : (va>vb ? 1 : 0);
+}
+
+
+// sort samples, must be called before getting percentiles
+static void seriesSort(Series_t *aSeries)
+{
+  if (aSeries->count>0) qsort(aSeries->values, aSeries->count, sizeof(uint32_t), compareValues);
+}
+
+
+static uint32_t seriesPercentile(Series_t *aSeries, int aPercent)
+{
+  int idx;
+
+  if (aSeries->count==0) return 0;
+  if (aPercent>=100) return aSeries->max;
+  idx = (int)(((long long)aSeries->count*aPercent+99)/100)-1; // nearest rank
+  if (idx<0) idx = 0;
+  return aSeries->values[idx];
+}
+
+
+static void seriesFree(Series_t *aSeries)
+{
+  free(aSeries->values);
+  aSeries->values = NULL;
+}
+
+
+static int getStats(int aFd, struct p44ledchain_stats *aStats)
+{
+  return ioctl(aFd, P44LEDCHAIN_IOC_GET_STATS, aStats)==0;
+}
+
+
+static void chainStatsInit(ChainStats_t *aChain, const char *aDevName, int aFd)
+{
+  memset(aChain, 0, sizeof(ChainStats_t));
+  aChain->devName = aDevName;
+  aChain->hasStats = getStats(aFd, &aChain->startStats);
+  aChain->lastStats = aChain->startStats;
+}
+
+
+// read driver statistics after a frame, record update duration and retries when an update has completed
+// - returns 0 if an update is still in progress, so its statistics are not final yet
+static int chainStatsSample(ChainStats_t *aChain, int aFd)
+{
+  struct p44ledchain_stats st;
+
+  if (!aChain->hasStats || !getStats(aFd, &st)) return 1;
+  // update statistics are reset when an update starts, so only sample when the chain is ready.
+  // Otherwise, keep updates since the last sample pending, a later sample will record them
+  if (!st.ready) return 0;
+  if (st.updates!=aChain->lastStats.updates || st.errors!=aChain->lastStats.errors) {
+    // updates done (or given up) since last sample
+    seriesAdd(&aChain->updateUs, st.last_update_us);
+    seriesAdd(&aChain->retries, st.retries-aChain->lastStats.retries);
+    seriesAdd(&aChain->irqDelayNs, st.max_irq_delay_ns);
+  }
+  aChain->lastStats = st;
+  return 1;
+}
+
+
+// record the last updates at the end of the run, waiting (up to a second) for the chain to become ready
+static void chainStatsFinish(ChainStats_t *aChain, int aFd)
+{
+  struct timespec ts;
+  int tries = 1000;
+
+  ts.tv_sec = 0;
+  ts.tv_nsec = 1000000; // 1mS
+  while (!chainStatsSample(aChain, aFd) && --tries>0) nanosleep(&ts, NULL);
+}
+
+
+static void printSeriesText(const char *aName, Series_t *aSeries)
+{
+  seriesSort(aSeries);
+  printf("  %-16s %8lld %8u %8u %8u %8u %8lld\n", aName, aSeries->seen,
+    seriesPercentile(aSeries, 50), seriesPercentile(aSeries, 95), seriesPercentile(aSeries, 99), aSeries->max,
+    aSeries->seen ? aSeries->sum/aSeries->seen : 0
+  );
+}
+
+
+static void printSeriesCSV(Series_t *aSeries)
+{
+  seriesSort(aSeries);
+  printf(",%u,%u,%u,%u", seriesPercentile(aSeries, 50), seriesPercentile(aSeries, 95), seriesPercentile(aSeries, 99), aSeries->max);
+}
+
+
+static void printSeriesJSON(const char *aName, Series_t *aSeries)
+{
+  seriesSort(aSeries);
+  printf("\"%s\":{\"count\":%lld,\"p50\":%u,\"p95\":%u,\"p99\":%u,\"max\":%u,\"avg\":%lld}", aName, aSeries->seen,
+    seriesPercentile(aSeries, 50), seriesPercentile(aSeries, 95), seriesPercentile(aSeries, 99), aSeries->max,
+    aSeries->seen ? aSeries->sum/aSeries->seen : 0
+  );
+}
+
+
+// print the report
+// - aTotalUs: total run time
+static void printReport(int aLoops, long long aTotalUs, Series_t *aGenerateUs, Series_t *aWaitUs, ChainStats_t *aChains, int aNumChains)
+{
+  int cidx;
+  ChainStats_t *ch;
+  double secs = aTotalUs/1e6;
+  uint32_t updates, retries, errors, overruns, superseded, skipped, irqs;
+  uint32_t allUpdates = 0, allRetries = 0, allErrors = 0;
+  double chSecs;
+
+  if (reportFormat==report_csv) {
+    printf("device,loops,seconds,loop_rate,frames,fps,retries,retries_per_frame,errors,error_rate,overruns,superseded,skipped,irqs");
+    printf(",generate_p50,generate_p95,generate_p99,generate_max,wait_p50,wait_p95,wait_p99,wait_max");
+    printf(",write_p50,write_p95,write_p99,write_max,update_p50,update_p95,update_p99,update_max");
+    printf(",irqdelay_ns_p50,irqdelay_ns_p95,irqdelay_ns_p99,irqdelay_ns_max,late_p50,late_p95,late_p99,late_max\n");
+  }
+  else if (reportFormat==report_json) {
+    printf("{\"loops\":%d,\"seconds\":%.3f,\"loop_rate\":%.2f,", aLoops, secs, secs>0 ? aLoops/secs : 0);
+    printSeriesJSON("generate_us", aGenerateUs); printf(",");
+    printSeriesJSON("wait_us", aWaitUs); printf(",\"chains\":[");
+  }
+  else {
+    printf("\nReport: %d loops in %.3f S = %.2f loops/S\n", aLoops, secs, secs>0 ? aLoops/secs : 0);
+    printf("  %-16s %8s %8s %8s %8s %8s %8s [µS]\n", "", "count", "p50", "p95", "p99", "max", "avg");
+    printSeriesText("generate", aGenerateUs);
+    printSeriesText("wait", aWaitUs);
+  }
+  for (cidx=0; cidx<aNumChains; cidx++) {
+    ch = &aChains[cidx];
+    updates = ch->lastStats.updates-ch->startStats.updates;
+    retries = ch->lastStats.retries-ch->startStats.retries;
+    errors = ch->lastStats.errors-ch->startStats.errors;
+    overruns = ch->lastStats.overruns-ch->startStats.overruns;
+    superseded = ch->lastStats.superseded-ch->startStats.superseded;
+    skipped = ch->lastStats.skipped-ch->startStats.skipped;
+    irqs = ch->lastStats.irq_count-ch->startStats.irq_count;
+    chSecs = ch->elapsedUs/1e6;
+    allUpdates += updates;
+    allRetries += retries;
+    allErrors += errors;
+    if (reportFormat==report_csv) {
+      printf("%s,%d,%.3f,%.2f,%u,%.2f,%u,%.4f,%u,%.4f,%u,%u,%u,%u", ch->devName, ch->loops, chSecs, chSecs>0 ? ch->loops/chSecs : 0,
+        updates, chSecs>0 ? updates/chSecs : 0, retries, updates ? (double)retries/updates : 0,
+        errors, updates ? (double)errors/updates : 0, overruns, superseded, skipped, irqs
+      );
+      printSeriesCSV(aGenerateUs);
+      printSeriesCSV(aWaitUs);
+      printSeriesCSV(&ch->writeUs);
+      printSeriesCSV(&ch->updateUs);
+      printSeriesCSV(&ch->irqDelayNs);
+      printSeriesCSV(&ch->lateUs);
+      printf("\n");
+    }
+    else if (reportFormat==report_json) {
+      printf("%s{\"device\":\"%s\",\"driver_stats\":%s,\"loops\":%d,\"seconds\":%.3f,\"frames\":%u,\"fps\":%.2f,\"retries\":%u,\"retries_per_frame\":%.4f,",
+        cidx>0 ? "," : "", ch->devName, ch->hasStats ? "true" : "false", ch->loops, chSecs, updates, chSecs>0 ? updates/chSecs : 0, retries, updates ? (double)retries/updates : 0
+      );
+      printf("\"errors\":%u,\"error_rate\":%.4f,\"overruns\":%u,\"superseded\":%u,\"skipped\":%u,\"irqs\":%u,",
+        errors, updates ? (double)errors/updates : 0, overruns, superseded, skipped, irqs
+      );
+      printSeriesJSON("write_us", &ch->writeUs); printf(",");
+      printSeriesJSON("update_us", &ch->updateUs); printf(",");
+      printSeriesJSON("retries", &ch->retries); printf(",");
+      printSeriesJSON("irqdelay_ns", &ch->irqDelayNs); printf(",");
+      printSeriesJSON("late_us", &ch->lateUs); printf("}");
+    }
+    else {
+      printf("%s: %d loops in %.3f S (%.2f/S)\n", ch->devName, ch->loops, chSecs, chSecs>0 ? ch->loops/chSecs : 0);
+      printSeriesText("write", &ch->writeUs);
+      if (ch->lateUs.seen>0) printSeriesText("late", &ch->lateUs);
+      if (!ch->hasStats) {
+        printf("  (no driver statistics available)\n");
+        continue;
+      }
+      printSeriesText("update", &ch->updateUs);
+      printSeriesText("retries/frame", &ch->retries);
+      printSeriesText("irq delay [nS]", &ch->irqDelayNs);
+      printf("  frames=%u (%.2f FPS), retries=%u (%.4f/frame), errors=%u (%.2f%%), overruns=%u, superseded=%u, skipped=%u, irqs=%u\n",
+        updates, chSecs>0 ? updates/chSecs : 0, retries, updates ? (double)retries/updates : 0,
+        errors, updates ? 100.0*errors/updates : 0, overruns, superseded, skipped, irqs
+      );
+    }
+  }
+  // aggregate over all chains
+  if (reportFormat==report_json) {
+    printf("],\"aggregate\":{\"frames\":%u,\"fps\":%.2f,\"retries\":%u,\"retries_per_frame\":%.4f,\"errors\":%u,\"error_rate\":%.4f}}\n",
+      allUpdates, secs>0 ? allUpdates/secs : 0, allRetries, allUpdates ? (double)allRetries/allUpdates : 0,
+      allErrors, allUpdates ? (double)allErrors/allUpdates : 0
+    );
+  }
+  else if (reportFormat==report_text && aNumChains>1) {
+    printf("all chains: frames=%u (%.2f FPS), retries=%u (%.4f/frame), errors=%u (%.2f%%)\n",
+      allUpdates, secs>0 ? allUpdates/secs : 0, allRetries, allUpdates ? (double)allRetries/allUpdates : 0,
+      allErrors, allUpdates ? 100.0*allErrors/allUpdates : 0
+    );
+  }
+}
+
+
+static void stopHandler(int aSig)
+{
+  stopRequested = 1;
+}
+
+
+// MARK: ===== LED patterns
+
+static void generatePattern(uint8_t *aLedBuffer, int aEidx, const uint8_t *aFgColor)
+{
+  int lidx;
+
+  switch(mode) {
+    case mode_static: {
+      for (lidx=0; lidx<numleds; lidx++) {
+        aLedBuffer[lidx*3+0] = aFgColor[0];
+        aLedBuffer[lidx*3+1] = aFgColor[1];
+        aLedBuffer[lidx*3+2] = aFgColor[2];
+      }
+      break;
+    }
+    case mode_fillup:
+    {
+      for (lidx=0; lidx<(aEidx%numleds); lidx++) {
+        aLedBuffer[lidx*3+0] = aFgColor[0];
+        aLedBuffer[lidx*3+1] = aFgColor[1];
+        aLedBuffer[lidx*3+2] = aFgColor[2];
+      }
+      for (; lidx<numleds; lidx++) {
+        aLedBuffer[lidx*3+0] = bgcolor[0];
+        aLedBuffer[lidx*3+1] = bgcolor[1];
+        aLedBuffer[lidx*3+2] = bgcolor[2];
+      }
+      break;
+    }
+    case mode_single:
+    {
+      for (lidx=0; lidx<numleds; lidx++) {
+        if ((aEidx%numleds)==lidx) {
+          aLedBuffer[lidx*3+0] = aFgColor[0];
+          aLedBuffer[lidx*3+1] = aFgColor[1];
+          aLedBuffer[lidx*3+2] = aFgColor[2];
+        }
+        else {
+          aLedBuffer[lidx*3+0] = bgcolor[0];
+          aLedBuffer[lidx*3+1] = bgcolor[1];
+          aLedBuffer[lidx*3+2] = bgcolor[2];
+        }
+      }
+      break;
+    }
+  }
+}
+
+
+// MARK: ===== frame file replay
+
+// Frame file: sequence of records, each consisting of
+// - 64-bit little endian timestamp in µS (relative to any origin), if -t
+// - header (length byte + header bytes, like written to p44-ledchain in variable led type mode), if -E
+// - LED data, frameBytes bytes
+
+typedef struct {
+  size_t offset; ///< offset of data to write (header, if any, and LED data) in the file
+  size_t len; ///< number of bytes to write
+  long long timestampUs; ///< recorded timestamp (0 if none)
+} ReplayFrame_t;
+
+const uint8_t *replayData = NULL; // mapped frame file
+size_t replaySize = 0;
+ReplayFrame_t *replayFrames = NULL;
+int numReplayFrames = 0;
+size_t maxReplayLen = 0;
+
+
+// map the frame file and index its frames
+static int loadReplayFile(void)
+{
+  int fd;
+  struct stat st;
+  size_t pos;
+  size_t len;
+  int i;
+  ReplayFrame_t *f;
+
+  fd = open(replayFile, O_RDONLY);
+  if (fd<0 || fstat(fd, &st)<0) {
+    fprintf(stderr, "cannot open frame file '%s': %s\n", replayFile, strerror(errno));
+    return 0;
+  }
+  replaySize = st.st_size;
+  if (replaySize>0) replayData = mmap(NULL, replaySize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd); // mapping stays valid
+  if (replaySize==0 || replayData==MAP_FAILED) {
+    fprintf(stderr, "cannot map frame file '%s': %s\n", replayFile, replaySize ? strerror(errno) : "empty");
+    return 0;
+  }
+  madvise((void *)replayData, replaySize, MADV_SEQUENTIAL);
+  // index frames (header length can vary per frame)
+  pos = 0;
+  while (1) {
+    len = (replayTimestamps ? 8 : 0) + frameBytes;
+    if (pos+len>replaySize) break;
+    if (replayHeaders) {
+      len += 1+replayData[pos+(replayTimestamps ? 8 : 0)];
+      if (pos+len>replaySize) break;
+    }
+    if ((numReplayFrames & 0x3FF)==0) {
+      replayFrames = realloc(replayFrames, (numReplayFrames+0x400)*sizeof(ReplayFrame_t));
+      if (!replayFrames) {
+        fprintf(stderr, "out of memory\n");
+        return 0;
+      }
+    }
+    f = &replayFrames[numReplayFrames++];
+    f->timestampUs = 0;
+    if (replayTimestamps) {
+      for (i=7; i>=0; i--) f->timestampUs = (f->timestampUs<<8) | replayData[pos+i];
+    }
+    f->offset = pos + (replayTimestamps ? 8 : 0);
+    f->len = pos+len-f->offset;
+    if (f->len>maxReplayLen) maxReplayLen = f->len;
+    pos += len;
+  }
+  if (pos<replaySize) {
+    fprintf(stderr, "warning: ignoring %zu bytes of incomplete frame at end of '%s'\n", replaySize-pos, replayFile);
+  }
+  if (numReplayFrames==0) {
+    fprintf(stderr, "no complete frame in frame file '%s'\n", replayFile);
+    return 0;
+  }
+  if (verbose) {
+    printf("Frame file '%s': %d frames", replayFile, numReplayFrames);
+    if (replayTimestamps) printf(", recorded duration: %lld mS", (replayFrames[numReplayFrames-1].timestampUs-replayFrames[0].timestampUs)/1000);
+    printf("\n");
+  }
+  return 1;
+}
+
+
+// get the data to write for update aUpdateIdx
+// - aRawBuffer, aHdrLen: buffer starting with the -H header, if any. Recorded LED data is copied
+//   behind the header, otherwise it is written directly from the mapped file
+static const uint8_t *replayFrameData(int aUpdateIdx, uint8_t *aRawBuffer, int aHdrLen, size_t *aLenP)
+{
+  const ReplayFrame_t *f = &replayFrames[aUpdateIdx % numReplayFrames];
+
+  if (aHdrLen>0) {
+    memcpy(aRawBuffer+aHdrLen, replayData+f->offset, f->len);
+    *aLenP = aHdrLen+f->len;
+    return aRawBuffer;
+  }
+  *aLenP = f->len;
+  return replayData+f->offset;
+}
+
+
+// time in µS from update aUpdateIdx to the next one
+static long long replayDelayUs(int aUpdateIdx, int aIntervalMs)
+{
+  int fi = aUpdateIdx % numReplayFrames;
+
+  if (replayMaxSpeed) return 0;
+  if (!replayTimestamps || fi+1>=numReplayFrames) return aIntervalMs*1000ll; // last frame stays for one interval before looping
+  return replayFrames[fi+1].timestampUs-replayFrames[fi].timestampUs;
+}
+
+
+// MARK: ===== concurrent chain updates
+
+// one chain updated by its own thread
+typedef struct {
+  int cidx; ///< chain index
+  int fd; ///< chain device
+  int interval; ///< update interval in mS
+  const uint8_t *header; ///< header data to send with every frame
+  int hdrlen; ///< header length
+  ChainStats_t *stats;
+  Series_t *generateUs;
+  Series_t *waitUs;
+  pthread_t thread;
+} ChainThread_t;
+
+
+static void *chainThread(void *aArg)
+{
+  ChainThread_t *ct = (ChainThread_t *)aArg;
+  uint8_t *rawbuffer;
+  uint8_t *ledbuffer;
+  uint8_t color[3];
+  struct timespec ts;
+  int loopidx;
+  int eidx;
+  long long nextStart;
+  long long loopStart;
+  long long beforeUpdate;
+  long long afterUpdate;
+  long long afterSleep;
+  long long threadStart;
+  const uint8_t *frameData;
+  size_t frameLen;
+
+  rawbuffer = malloc((maxReplayLen>numleds*3 ? maxReplayLen : numleds*3)+maxhdrlen+1);
+  if (!rawbuffer) return NULL;
+  memcpy(rawbuffer, ct->header, ct->hdrlen);
+  ledbuffer = rawbuffer+ct->hdrlen;
+  memcpy(color, fgcolor, 3);
+  eidx = 0;
+  threadStart = now();
+  // absolute schedule, so the interval of the chain does not depend on the time updating takes
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  nextStart = (long long)ts.tv_sec*1000000000ll + ts.tv_nsec;
+  for (loopidx = 0; (numupdates==0||loopidx<numupdates) && !stopRequested; loopidx++) {
+    loopStart = now();
+    if (replayFile) {
+      frameData = replayFrameData(loopidx, rawbuffer, ct->hdrlen, &frameLen);
+    }
+    else {
+      generatePattern(ledbuffer, eidx, color);
+      frameData = rawbuffer;
+      frameLen = numleds*3+ct->hdrlen;
+    }
+    beforeUpdate = now();
+    write(ct->fd, frameData, frameLen);
+    afterUpdate = now();
+    if (replayFile && report) seriesAdd(&ct->stats->lateUs, beforeUpdate>nextStart/1000 ? beforeUpdate-nextStart/1000 : 0);
+    // wait for next interval
+    nextStart += replayFile ? replayDelayUs(loopidx, ct->interval)*1000ll : ct->interval*1000000ll;
+    ts.tv_sec = nextStart/1000000000ll;
+    ts.tv_nsec = nextStart%1000000000ll;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    afterSleep = now();
+    if (report) {
+      pthread_mutex_lock(&statsLock);
+      seriesAdd(ct->generateUs, beforeUpdate-loopStart);
+      seriesAdd(ct->waitUs, afterSleep-afterUpdate);
+      pthread_mutex_unlock(&statsLock);
+      seriesAdd(&ct->stats->writeUs, afterUpdate-beforeUpdate);
+      chainStatsSample(ct->stats, ct->fd);
+    }
+    ct->stats->loops++;
+    if (verbose) {
+      printf("Chain #%d loop #%d: THIS loop:%lld, generate: %lld, update: %lld, wait: %lld [µS]\n",
+        ct->cidx,
+        loopidx,
+        afterSleep-loopStart,
+        beforeUpdate-loopStart,
+        afterUpdate-beforeUpdate,
+        afterSleep-afterUpdate
+      );
+    }
+    eidx += effectinc;
+    color[0] += colorstep[0];
+    color[1] += colorstep[1];
+    color[2] += colorstep[2];
+    ct->stats->elapsedUs = now()-threadStart;
+  }
+  free(rawbuffer);
+  return NULL;
+}
+
+
 int main(int argc, char **argv)
 {
   int chainFds[maxchains];
+  ChainStats_t chainStats[maxchains];
+  ChainThread_t chainThreads[maxchains];
+  Series_t generateUs;
+  Series_t waitUs;
   int numchains;
-  int loopidx, cidx, lidx, eidx;
+  int loopidx, cidx, eidx;
   struct timespec ts;
   uint8_t *rawbuffer;
   uint8_t *ledbuffer;
@@ -106,6 +674,10 @@ int main(int argc, char **argv)
   long long lastAfterSleep;
   long long total;
   long long wait;
+  long long beforeWrite;
+  long long nextDue;
+  const uint8_t *frameData;
+  size_t frameLen;
 
   if (argc<2) {
     // show usage
@@ -114,7 +686,7 @@ int main(int argc, char **argv)
   }
 
   int c;
-  while ((c = getopt(argc, argv, "hH:n:i:e:r:c:b:s:vFS")) != -1)
+  while ((c = getopt(argc, argv, "hH:n:i:e:r:c:b:s:vFSRf:TP:z:tEX")) != -1)
   {
     switch (c) {
       case 'h':
@@ -123,9 +695,15 @@ int main(int argc, char **argv)
       case 'n':
         numleds = atoi(optarg);
         break;
-      case 'i':
-        interval = atoi(optarg);
+      case 'i': {
+        char *p = optarg;
+        numintervals = 0;
+        do {
+          if (numintervals<maxchains) intervals[numintervals++] = (int)strtol(p, &p, 10);
+        } while (*p++==',');
+        interval = intervals[0];
         break;
+      }
       case 'e':
         effectinc = atoi(optarg);
         break;
@@ -153,18 +731,50 @@ int main(int argc, char **argv)
       case 'S':
         mode = mode_single;
         break;
+      case 'R':
+        report = 1;
+        break;
+      case 'T':
+        threaded = 1;
+        break;
+      case 'P':
+        replayFile = optarg;
+        break;
+      case 'z':
+        frameBytes = atoi(optarg);
+        break;
+      case 't':
+        replayTimestamps = 1;
+        break;
+      case 'E':
+        replayHeaders = 1;
+        break;
+      case 'X':
+        replayMaxSpeed = 1;
+        break;
+      case 'f':
+        report = 1;
+        if (strcmp(optarg, "csv")==0) reportFormat = report_csv;
+        else if (strcmp(optarg, "json")==0) reportFormat = report_json;
+        else if (strcmp(optarg, "text")==0) reportFormat = report_text;
+        else {
+          fprintf(stderr, "unknown report format '%s'\n", optarg);
+          exit(1);
+        }
+        break;
       default:
         exit(-1);
     }
   }
   // open chains
   numchains = 0;
-  while (optind<argc) {
+  while (optind<argc && numchains<maxchains) {
     chainFds[numchains] = open(argv[optind], O_RDWR);
     if (chainFds[numchains]<0) {
       fprintf(stderr, "cannot open ledchain device '%s': %s\n", argv[optind], strerror(errno));
       exit(1);
     }
+    chainStatsInit(&chainStats[numchains], argv[optind], chainFds[numchains]);
     numchains++;
     optind++;
   }
@@ -172,8 +782,19 @@ int main(int argc, char **argv)
     fprintf(stderr, "must specify at least one LED chain device\n");
     exit(1);
   }
+  // frames to send
+  numupdates = repeats;
+  if (replayFile) {
+    if (frameBytes<=0) frameBytes = numleds*3;
+    if (replayHeaders && headerStr) {
+      fprintf(stderr, "-H cannot be used with frames containing a header (-E)\n");
+      exit(1);
+    }
+    if (!loadReplayFile()) exit(1);
+    numupdates = repeats*numReplayFrames;
+  }
   // allocate buffer
-  rawbuffer = malloc(numleds*3+maxhdrlen+1);
+  rawbuffer = malloc((maxReplayLen>numleds*3 ? maxReplayLen : numleds*3)+maxhdrlen+1);
   ledbuffer = rawbuffer;
   // maybe we have a header
   if (headerStr) {
@@ -186,67 +807,92 @@ int main(int argc, char **argv)
     }
     *rawbuffer = hdrlen-1;
   }
-  // loop
+  // report: stop with ^C still prints the report
+  memset(&generateUs, 0, sizeof(generateUs));
+  memset(&waitUs, 0, sizeof(waitUs));
+  if (report || threaded) {
+    signal(SIGINT, stopHandler);
+    signal(SIGTERM, stopHandler);
+  }
   start = now();
+  afterSleep = start; // first loop has no previous printf
+  afterPrint = start;
+  total = 0;
+  loopidx = 0;
+  if (threaded) {
+    // one thread per chain
+    for (cidx = 0; cidx<numchains; cidx++) {
+      chainThreads[cidx].cidx = cidx;
+      chainThreads[cidx].fd = chainFds[cidx];
+      chainThreads[cidx].interval = numintervals>0 ? intervals[cidx<numintervals ? cidx : numintervals-1] : interval;
+      chainThreads[cidx].header = rawbuffer;
+      chainThreads[cidx].hdrlen = hdrlen;
+      chainThreads[cidx].stats = &chainStats[cidx];
+      chainThreads[cidx].generateUs = &generateUs;
+      chainThreads[cidx].waitUs = &waitUs;
+      if (pthread_create(&chainThreads[cidx].thread, NULL, chainThread, &chainThreads[cidx])!=0) {
+        fprintf(stderr, "cannot create thread for chain #%d\n", cidx);
+        exit(1);
+      }
+    }
+    for (cidx = 0; cidx<numchains; cidx++) {
+      pthread_join(chainThreads[cidx].thread, NULL);
+      loopidx += chainStats[cidx].loops;
+    }
+    total = now()-start;
+  }
+  // loop
   eidx = 0; // effect index
-  for (loopidx = 0; repeats==0||loopidx<repeats; loopidx++) {
+  nextDue = start;
+  for (; !threaded && (numupdates==0||loopidx<numupdates) && !stopRequested; loopidx++) {
     loopStart = now();
     // prepare pattern
-    switch(mode) {
-      case mode_static: {
-        for (lidx=0; lidx<numleds; lidx++) {
-          ledbuffer[lidx*3+0] = fgcolor[0];
-          ledbuffer[lidx*3+1] = fgcolor[1];
-          ledbuffer[lidx*3+2] = fgcolor[2];
-        }
-        break;
-      }
-      case mode_fillup:
-      {
-        for (lidx=0; lidx<(eidx%numleds); lidx++) {
-          ledbuffer[lidx*3+0] = fgcolor[0];
-          ledbuffer[lidx*3+1] = fgcolor[1];
-          ledbuffer[lidx*3+2] = fgcolor[2];
-        }
-        for (; lidx<numleds; lidx++) {
-          ledbuffer[lidx*3+0] = bgcolor[0];
-          ledbuffer[lidx*3+1] = bgcolor[1];
-          ledbuffer[lidx*3+2] = bgcolor[2];
-        }
-        break;
-      }
-      case mode_single:
-      {
-        for (lidx=0; lidx<numleds; lidx++) {
-          if ((eidx%numleds)==lidx) {
-            ledbuffer[lidx*3+0] = fgcolor[0];
-            ledbuffer[lidx*3+1] = fgcolor[1];
-            ledbuffer[lidx*3+2] = fgcolor[2];
-          }
-          else {
-            ledbuffer[lidx*3+0] = bgcolor[0];
-            ledbuffer[lidx*3+1] = bgcolor[1];
-            ledbuffer[lidx*3+2] = bgcolor[2];
-          }
-        }
-        break;
-      }
+    if (replayFile) {
+      frameData = replayFrameData(loopidx, rawbuffer, hdrlen, &frameLen);
+    }
+    else {
+      generatePattern(ledbuffer, eidx, fgcolor);
+      frameData = rawbuffer;
+      frameLen = numleds*3+hdrlen;
     }
     // update chains
     beforeUpdate = now();
     for (cidx = 0; cidx<numchains; cidx++) {
-      write(chainFds[cidx], rawbuffer, numleds*3+hdrlen);
+      beforeWrite = now();
+      write(chainFds[cidx], frameData, frameLen);
+      if (report) {
+        seriesAdd(&chainStats[cidx].writeUs, now()-beforeWrite);
+        if (replayFile) seriesAdd(&chainStats[cidx].lateUs, beforeWrite>nextDue ? beforeWrite-nextDue : 0);
+      }
+      chainStats[cidx].loops++;
     }
     afterUpdate = now();
     // calculate remaining wait time
-    wait = interval*1000 - (afterUpdate-loopStart);
+    if (replayFile) {
+      // recorded timing, independent of the time updating takes
+      nextDue += replayDelayUs(loopidx, interval);
+      wait = nextDue-afterUpdate;
+    }
+    else {
+      wait = interval*1000 - (afterUpdate-loopStart);
+    }
     // wait
-    ts.tv_sec = wait/1000000;
-    ts.tv_nsec = (wait%1000000)*1000;
-    nanosleep(&ts, NULL);
+    if (wait>0) {
+      ts.tv_sec = wait/1000000;
+      ts.tv_nsec = (wait%1000000)*1000;
+      nanosleep(&ts, NULL);
+    }
     lastAfterSleep = afterSleep;
     afterSleep = now();
     total = now()-start;
+    if (report) {
+      seriesAdd(&generateUs, beforeUpdate-loopStart);
+      seriesAdd(&waitUs, afterSleep-afterUpdate);
+      for (cidx = 0; cidx<numchains; cidx++) {
+        chainStatsSample(&chainStats[cidx], chainFds[cidx]);
+        chainStats[cidx].elapsedUs = total;
+      }
+    }
     // statistics
     if (verbose) {
       printf("Loop #%d: TOTAL:%lld, average loop: %lld - THIS loop:%lld, generate: %lld, update: %lld, wait: %lld, prev. printf: %lld [µS]\n",
@@ -266,13 +912,30 @@ int main(int argc, char **argv)
     fgcolor[1] += colorstep[1];
     fgcolor[2] += colorstep[2];
   }
-  printf("TOTAL time: %lld, average per loop: %lld [microseconds]\n", total, total/loopidx);
+  if (report) {
+    for (cidx = 0; cidx<numchains; cidx++) chainStatsFinish(&chainStats[cidx], chainFds[cidx]);
+    printReport(loopidx, total, &generateUs, &waitUs, chainStats, numchains);
+    seriesFree(&generateUs);
+    seriesFree(&waitUs);
+    for (cidx = 0; cidx<numchains; cidx++) {
+      seriesFree(&chainStats[cidx].writeUs);
+      seriesFree(&chainStats[cidx].updateUs);
+      seriesFree(&chainStats[cidx].retries);
+      seriesFree(&chainStats[cidx].irqDelayNs);
+      seriesFree(&chainStats[cidx].lateUs);
+    }
+  }
+  if (reportFormat==report_text || !report) {
+    printf("TOTAL time: %lld, average per loop: %lld [microseconds]\n", total, loopidx ? total/loopidx : 0);
+  }
   // close
   for (cidx = 0; cidx<numchains; cidx++) {
     close(chainFds[cidx]);
   }
   // free buffer
   free(rawbuffer); rawbuffer = NULL; ledbuffer = NULL;
+  if (replayData) munmap((void *)replayData, replaySize);
+  free(replayFrames);
   // done
   exit(0);
 }